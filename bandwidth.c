@@ -0,0 +1,320 @@
+// Fair shares of the uplink for paced streams.
+// Each stream, each client address and the server as a whole may be given
+// a cap in KB/s (conf.streamcap, conf.clientcap, conf.egresscap).  Each
+// cap is a token bucket that refills at its rate and is spent a chunk at a
+// time; a chunk may be sent while every bucket it draws on is positive.
+// The buckets of the client addresses and the total are shared by all
+// threads under one mutex.  A client's bucket outlives its last stream for
+// a while, so reconnecting doesn't earn it a fresh one, and clients that
+// find no free slot share one overflow bucket.  A chunk that can't be sent is parked on its
+// evhtp thread.  A timer then serves the parked streams by deficit round
+// robin, weighting each by its song's bitrate.  Streams whose client holds
+// less than half the lead are served first.  The others may only
+// take from the total while it holds more than half a second of the
+// bitrate of every stream, so every listener gets its bitrate before
+// anyone gets more.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include "system.h"
+#include "config.h"
+#include "bandwidth.h"
+
+#define CLIENTS     256         // addresses capped at once
+#define LINGER_US   10000000    // a client's bucket is kept after its streams
+#define TICK_US     20000       // while streams are parked
+#define MAX_ROUNDS  256
+#define RESERVE_S   0.5         // of every stream's bitrate, kept from bursts
+
+typedef struct bw_bucket {
+    double    tokens;           // bytes; may go negative
+    double    rate;             // bytes per second, 0 for no cap
+    uint64_t  last;             // usecs, monotonic
+} bw_bucket;
+
+typedef struct bw_client {
+    unsigned char addr[16];     // IPv4 as a v4-mapped IPv6 address
+    int       flows;
+    uint64_t  idle;             // when flows last fell to 0
+    bw_bucket b;                // b.last is 0 if the slot was never used
+} bw_client;
+
+struct bw_flow {
+    struct bw_thread *thr;
+    bw_client        *client;
+    bw_bucket         b;
+    size_t            rate;     // the song's, bytes per second
+    size_t            len;      // the chunk waiting
+    int               due;      // the client is short of audio
+    double            deficit;
+    int               parked;
+    void            (*ready)(void *);
+    void             *arg;
+    struct bw_flow   *prev, *next;
+};
+
+typedef struct bw_thread {
+    struct event     *tick;
+    BWFLOW           *head, *tail;
+} bw_thread;
+
+static pthread_mutex_t  bw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bw_bucket        egress   = { 0, 0, 0 };
+static bw_client        clients[CLIENTS];
+static bw_client        overflow;       // for clients without a slot
+static double           reserved = 0;   // the bitrates of every stream
+
+static uint64_t _now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// a bucket holds at most a second at its rate, or a chunk if that's more
+static void _refill(bw_bucket *b, uint64_t now) {
+    if (!b->rate) return;
+    double depth = b->rate > conf.chunksize ? b->rate : conf.chunksize;
+    b->tokens += b->rate * (now - b->last) / 1e6;
+    if (b->tokens > depth)
+        b->tokens = depth;
+    b->last = now;
+}
+
+static void _bucket_init(bw_bucket *b, long kbps, uint64_t now) {
+    b->rate   = kbps > 0 ? kbps * 1024.0 : 0;
+    b->tokens = b->rate;
+    b->last   = now;
+}
+
+// the address of an IPv4 or IPv6 client, as 16 bytes
+static int _key(struct sockaddr *addr, unsigned char *key) {
+    memset(key, 0, 16);
+    if (addr && addr->sa_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((struct sockaddr_in *)addr)->sin_addr, 4);
+        return 1;
+    }
+    if (addr && addr->sa_family == AF_INET6) {
+        memcpy(key, &((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        return 1;
+    }
+    return 0;
+}
+
+// the client's bucket: its slot while it has streams or has had them
+// lately, else a free slot, else the overflow bucket
+static bw_client *_client(struct sockaddr *addr, uint64_t now) {
+    if (conf.clientcap <= 0)
+        return NULL;
+    unsigned char key[16];
+    bw_client *slot = NULL;
+    if (_key(addr, key)) {
+        uint32_t h = 2166136261u;
+        for (int i = 0; i < 16; i++)
+            h = (h ^ key[i]) * 16777619u;
+        for (int i = 0; i < CLIENTS; i++) {
+            bw_client *c = &clients[(h + i) % CLIENTS];
+            int live = c->flows || (c->b.last && now - c->idle < LINGER_US);
+            if (live && !memcmp(c->addr, key, 16))
+                return c;
+            if (!live && !slot)
+                slot = c;
+        }
+    }
+    if (!slot) {
+        if (!overflow.b.last)
+            _bucket_init(&overflow.b, conf.clientcap, now);
+        return &overflow;
+    }
+    memcpy(slot->addr, key, 16);
+    _bucket_init(&slot->b, conf.clientcap, now);
+    return slot;
+}
+
+// take len from every bucket the flow draws on, if they all allow it.
+// called with bw_mutex held.
+static int _admit(BWFLOW *f, size_t len, int due, uint64_t now) {
+    _refill(&f->b, now);
+    if (f->b.rate && f->b.tokens <= 0)
+        return 0;
+    if (f->client) {
+        _refill(&f->client->b, now);
+        if (f->client->b.tokens <= 0)
+            return 0;
+    }
+    if (egress.rate) {
+        _refill(&egress, now);
+        double keep = 0;
+        if (!due)
+            keep = (reserved < egress.rate ? reserved : egress.rate) * RESERVE_S;
+        if (egress.tokens <= keep)
+            return 0;
+        egress.tokens -= len;
+    }
+    if (f->b.rate)
+        f->b.tokens -= len;
+    if (f->client)
+        f->client->b.tokens -= len;
+    return 1;
+}
+
+static void _unpark(BWFLOW *f) {
+    bw_thread *t = f->thr;
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        t->head = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    else
+        t->tail = f->prev;
+    f->prev = f->next = NULL;
+    f->parked = 0;
+}
+
+/**
+ * @brief serve the parked flows: those that are due, then the rest, each
+ *        round adding to every flow's deficit in proportion to its
+ *        bitrate, until the buckets run dry or nothing is left waiting.
+ */
+static void _tick_cb(evutil_socket_t fd, short events, void *arg) {
+    bw_thread *t = (bw_thread *)arg;
+    BWFLOW *granted = NULL, *f, *next;
+    uint64_t now = _now();
+    pthread_mutex_lock(&bw_mutex);
+    for (int due = 1; due >= 0; due--) {
+        for (int round = 0; round < MAX_ROUNDS; round++) {
+            int waiting = 0, refused = 0;
+            for (f = t->head; f; f = next) {
+                next = f->next;
+                if (f->due != due) continue;
+                waiting++;
+                f->deficit += f->rate * (TICK_US / 1e6);
+                if (f->deficit < f->len) continue;
+                if (!_admit(f, f->len, due, now)) {
+                    refused++;
+                    f->deficit = f->len;
+                    continue;
+                }
+                f->deficit -= f->len;
+                _unpark(f);
+                f->next = granted;
+                granted = f;
+            }
+            if (!waiting || refused == waiting) break;
+        }
+    }
+    int parked = t->head != NULL;
+    pthread_mutex_unlock(&bw_mutex);
+    for (f = granted; f; f = next) {
+        next = f->next;
+        f->next = NULL;
+        f->ready(f->arg);
+    }
+    if (parked) {
+        struct timeval tv = { 0, TICK_US };
+        evtimer_add(t->tick, &tv);
+    }
+}
+
+void bw_init_thread(app *aux) {
+    aux->bandwidth = NULL;
+    if (conf.streamcap <= 0 && conf.clientcap <= 0 && conf.egresscap <= 0)
+        return;
+    pthread_mutex_lock(&bw_mutex);
+    if (!egress.last)
+        _bucket_init(&egress, conf.egresscap, _now());
+    pthread_mutex_unlock(&bw_mutex);
+    bw_thread *t = calloc(1, sizeof(bw_thread));
+    t->tick = evtimer_new(aux->base, _tick_cb, t);
+    aux->bandwidth = t;
+}
+
+void bw_term_thread(app *aux) {
+    bw_thread *t = aux->bandwidth;
+    if (!t) return;
+    pthread_mutex_lock(&bw_mutex);
+    while (t->head)
+        _unpark(t->head);
+    pthread_mutex_unlock(&bw_mutex);
+    event_free(t->tick);
+    free(t);
+    aux->bandwidth = NULL;
+}
+
+/**
+ * @brief start capping a stream of a song that plays at rate bytes per
+ *        second.  ready(arg) is called on this thread when a chunk that
+ *        bw_request() parked may be sent.
+ * @return the flow, or NULL if no caps are configured.
+ */
+BWFLOW *bw_open(app *aux, struct sockaddr *addr, size_t rate,
+                void (*ready)(void *), void *arg) {
+    if (!aux->bandwidth) return NULL;
+    uint64_t now = _now();
+    BWFLOW *f = calloc(1, sizeof(BWFLOW));
+    f->thr   = aux->bandwidth;
+    f->rate  = rate;
+    f->ready = ready;
+    f->arg   = arg;
+    _bucket_init(&f->b, conf.streamcap, now);
+    pthread_mutex_lock(&bw_mutex);
+    f->client = _client(addr, now);
+    if (f->client)
+        f->client->flows++;
+    reserved += rate;
+    pthread_mutex_unlock(&bw_mutex);
+    return f;
+}
+
+void bw_close(BWFLOW *f) {
+    pthread_mutex_lock(&bw_mutex);
+    if (f->parked)
+        _unpark(f);
+    if (f->client && --f->client->flows == 0)
+        f->client->idle = _now();
+    reserved -= f->rate;
+    pthread_mutex_unlock(&bw_mutex);
+    free(f);
+}
+
+/**
+ * @brief ask to send a chunk of len bytes.  due is set if the client is
+ *        short of audio.
+ * @return 1 if it may be sent now, or 0 if it has been parked, and the
+ *         flow's ready callback will say when it may.
+ */
+int bw_request(BWFLOW *f, size_t len, int due) {
+    bw_thread *t = f->thr;
+    pthread_mutex_lock(&bw_mutex);
+// nothing goes ahead of a parked flow that is as due
+    int queued = 0;
+    for (BWFLOW *p = t->head; p && !queued; p = p->next)
+        queued = p->due >= due;
+    if (!queued && _admit(f, len, due, _now())) {
+        pthread_mutex_unlock(&bw_mutex);
+        return 1;
+    }
+    f->len     = len;
+    f->due     = due;
+    f->deficit = 0;
+    f->parked  = 1;
+    f->next    = NULL;
+    f->prev    = t->tail;
+    if (t->tail)
+        t->tail->next = f;
+    else
+        t->head = f;
+    t->tail = f;
+    pthread_mutex_unlock(&bw_mutex);
+    if (!evtimer_pending(t->tick, NULL)) {
+        struct timeval tv = { 0, TICK_US };
+        evtimer_add(t->tick, &tv);
+    }
+    return 0;
+}
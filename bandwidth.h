@@ -0,0 +1,19 @@
+#ifndef __BANDWIDTH_H__
+#define __BANDWIDTH_H__
+#include <stddef.h>
+#include <sys/socket.h>
+#include "util.h"
+
+// egress caps for paced streams: per stream, per client address, and in
+// total.  a chunk the caps won't take now waits its turn on its thread, and
+// streams whose clients are short of audio go before those filling up.
+
+typedef struct bw_flow BWFLOW;
+
+void    bw_init_thread(app *aux);
+void    bw_term_thread(app *aux);
+BWFLOW *bw_open       (app *aux, struct sockaddr *addr, size_t rate,
+                       void (*ready)(void *), void *arg);
+void    bw_close      (BWFLOW *f);
+int     bw_request    (BWFLOW *f, size_t len, int due);
+#endif
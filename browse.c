@@ -0,0 +1,259 @@
+// Browse listings from in-memory indexes.
+// Each field's values are held in one sorted array of pointers into a 
+// single string pool.  An index is immutable once built and reference
+// counted, so a request works from the index it picked up while a newer 
+// one is swapped in behind it.  Prefix filters and index= ranges are
+// answered by binary search over the array.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <evhtp/evhtp.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "dmap.h"
+#include "util.h"
+#include "sql.h"
+#include "writer.h"
+#include "http.h"
+#include "browse.h"
+
+typedef struct browse_index {
+    volatile int   refs;
+    uint64_t       revision;    // the revision it was built at
+    long           n;
+    const char   **values;
+    size_t        *lens;
+    char          *pool;
+} browse_index;
+
+typedef struct browse_def {
+    const char  *name;          // as in the uri
+    const char  *tag;           // the listing tag
+    const char  *meta_tag;      // as in filter=
+    q_type       query;
+} browse_def;
+
+static const browse_def defs[] = {
+    { "artists",   "abar", "daap.songartist",   Q_BROWSE_ARTISTS   },
+    { "albums",    "abal", "daap.songalbum",    Q_BROWSE_ALBUMS    },
+    { "genres",    "abgn", "daap.songgenre",    Q_BROWSE_GENRES    },
+    { "composers", "abcp", "daap.songcomposer", Q_BROWSE_COMPOSERS },
+};
+
+static browse_index    *indexes[B_MAX];
+static uint64_t         changed[B_MAX] = { 1, 1, 1, 1 };
+static pthread_mutex_t  browse_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  build_mutex[B_MAX] = { 
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER 
+};
+
+static void _release(browse_index *idx) {
+    if (idx && __sync_sub_and_fetch(&idx->refs, 1) == 0) {
+        free(idx->values);
+        free(idx->lens);
+        free(idx->pool);
+        free(idx);
+    }
+}
+
+static int _compare(const void *a, const void *b) {
+    const char *x = *(const char **)a, *y = *(const char **)b;
+    int c = strcasecmp(x, y);
+    return c ? c : strcmp(x, y);
+}
+
+static browse_index *_build(app *aux, browse_field f, uint64_t revision) {
+    sqlite3_stmt *stmt = aux->stmts[defs[f].query];
+    size_t used = 0, size = 4096;
+    long n = 0, cap = 256;
+    size_t *ofs = malloc(cap * sizeof(size_t));
+    char *pool = malloc(size);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *str = (const char *)sqlite3_column_text(stmt, 0);
+        size_t len = sqlite3_column_bytes(stmt, 0);
+        if (!str) continue;
+        while (used + len + 1 > size)
+            pool = realloc(pool, size *= 2);
+        if (n == cap)
+            ofs = realloc(ofs, (cap *= 2) * sizeof(size_t));
+        memcpy(pool + used, str, len + 1);
+        ofs[n++] = used;
+        used += len + 1;
+    }
+    sqlite3_reset(stmt);
+    browse_index *idx = malloc(sizeof(browse_index));
+    idx->refs     = 1;  // the reference held by indexes[]
+    idx->revision = revision;
+    idx->pool     = pool;
+    idx->values   = malloc((n ? n : 1) * sizeof(char *));
+    idx->lens     = malloc((n ? n : 1) * sizeof(size_t));
+    for (long i = 0; i < n; i++)
+        idx->values[i] = pool + ofs[i];
+    free(ofs);
+    qsort(idx->values, n, sizeof(char *), _compare);
+// drop duplicates, which the sort has made adjacent
+    long kept = 0;
+    for (long i = 0; i < n; i++)
+        if (kept == 0 || strcmp(idx->values[kept - 1], idx->values[i]))
+            idx->values[kept++] = idx->values[i];
+    idx->n = kept;
+    for (long i = 0; i < kept; i++)
+        idx->lens[i] = strlen(idx->values[i]);
+    LOGGER(LOG_INFO, "built browse index '%s': %ld values", 
+                     defs[f].name, kept);
+    return idx;
+}
+
+/**
+ * @brief called by the writer as it commits: the given fields may have
+ *        changed as of revision.
+ */
+void browse_invalidate(int fields, uint64_t revision) {
+    pthread_mutex_lock(&browse_mutex);
+    for (int f = 0; f < B_MAX; f++)
+        if (fields & (1 << f))
+            changed[f] = revision;
+    pthread_mutex_unlock(&browse_mutex);
+}
+
+// the current index for a field, rebuilding it first if it is stale
+static browse_index *_acquire(app *aux, browse_field f) {
+    browse_index *idx;
+    uint64_t revision;
+    pthread_mutex_lock(&build_mutex[f]);
+    pthread_mutex_lock(&browse_mutex);
+    idx = indexes[f];
+    if (idx && idx->revision >= changed[f]) {
+        __sync_add_and_fetch(&idx->refs, 1);
+        pthread_mutex_unlock(&browse_mutex);
+        pthread_mutex_unlock(&build_mutex[f]);
+        return idx;
+    }
+    pthread_mutex_unlock(&browse_mutex);
+// read the revision before the values, so a commit in between only makes
+// the new index look stale
+    revision = db_current_revision();
+    idx = _build(aux, f, revision);
+    __sync_add_and_fetch(&idx->refs, 1);  // the caller's reference
+    pthread_mutex_lock(&browse_mutex);
+    _release(indexes[f]);
+    indexes[f] = idx;
+    pthread_mutex_unlock(&browse_mutex);
+    pthread_mutex_unlock(&build_mutex[f]);
+    return idx;
+}
+
+// the first value not sorting before prefix, comparing only its length
+static long _lower_bound(browse_index *idx, const char *prefix, size_t len) {
+    long lo = 0, hi = idx->n;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (strncasecmp(idx->values[mid], prefix, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static long _upper_bound(browse_index *idx, const char *prefix, size_t len) {
+    long lo = 0, hi = idx->n;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (strncasecmp(idx->values[mid], prefix, len) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief narrow [*first, *last) to the values matching a filter of the 
+ *        form 'daap.songartist:Val' (exact) or 'daap.songartist:Val*' 
+ *        (prefix), compared without regard to case.  filters on other 
+ *        fields, or negated ones, are ignored.
+ */
+static void _filter(browse_index *idx, const browse_def *def, 
+                    const char *raw, long *first, long *last) {
+    size_t rlen = strlen(raw);
+    unsigned char *filter = calloc(rlen + 1, 1);
+    if (evhtp_unescape_string(&filter, (unsigned char *)raw, rlen) != 0) {
+        free(filter);
+        return;
+    }
+    char *p = (char *)filter;
+    while (*p == '(' || *p == '\'' || *p == '"') p++;
+    size_t mlen = strlen(def->meta_tag);
+    if (strncmp(p, def->meta_tag, mlen) || p[mlen] != ':') {
+        free(filter);
+        return;
+    }
+    char *value = p + mlen + 1;
+    size_t len = strlen(value);
+    while (len && strchr(")'\"", value[len - 1])) len--;
+    int prefix = len && value[len - 1] == '*';
+    if (prefix) len--;
+    value[len] = '\0';
+    *first = _lower_bound(idx, value, len);
+    *last  = _upper_bound(idx, value, len);
+// an exact match must also be the same length
+    if (!prefix) {
+        while (*first < *last && idx->lens[*first] != len) (*first)++;
+        long end = *first;
+        while (end < *last && idx->lens[end] == len) end++;
+        *last = end;
+    }
+    free(filter);
+}
+
+void res_browse(evhtp_request_t *req, void *a) {
+    log_request(req, a);
+    add_headers_out(req);
+    ADD_DATE_HEADER("Date");
+    evthr_t *thread = evhtp_request_get_connection(req)->thread;
+    app *aux = (app *)evthr_get_aux(thread);
+    const char *name = req->uri->path->file;
+    browse_field f;
+    for (f = 0; f < B_MAX; f++)
+        if (name && !strcmp(name, defs[f].name)) break;
+    if (f == B_MAX) {
+        LOGGER(LOG_ERR, "unknown browse listing '%s'", STR(name));
+        evhtp_send_reply(req, EVHTP_RES_NOTFOUND);
+        return;
+    }
+    browse_index *idx = _acquire(aux, f);
+    long first = 0, last = idx->n;
+    const char *filter = evhtp_kv_find(req->uri->query, "filter");
+    if (filter)
+        _filter(idx, defs + f, filter, &first, &last);
+    long total = last - first;
+// index=a-b selects by position within the matching values
+    const char *range = evhtp_kv_find(req->uri->query, "index");
+    if (range) {
+        long lo = 0, hi = total - 1;
+        int n = sscanf(range, "%ld-%ld", &lo, &hi);
+        if (n < 1 || lo < 0) lo = 0;
+        if (n == 1) hi = lo;
+        if (hi > total - 1) hi = total - 1;
+        if (lo > hi) lo = hi + 1;
+        last  = first + hi + 1;
+        first = first + lo;
+    }
+    DMAPBUF *body = dmap_buf_new(64 + (last - first) * 32);
+    size_t list = dmap_buf_open_list(body, "abro");
+    dmap_buf_int (body, "mstt", 200);
+    dmap_buf_char(body, "muty", 0);
+    dmap_buf_int (body, "mtco", total);
+    dmap_buf_int (body, "mrco", last - first);
+    size_t values = dmap_buf_open_list(body, defs[f].tag);
+    for (long i = first; i < last; i++)
+        dmap_buf_string_n(body, "mlit", idx->values[i], idx->lens[i]);
+    dmap_buf_close_list(body, values);
+    dmap_buf_close_list(body, list);
+    dmap_buf_send(body, req->buffer_out);
+    dmap_buf_free(body);
+    LOGGER(LOG_INFO, "sent %ld of %ld %s.", last - first, total, defs[f].name);
+    _release(idx);
+    evhtp_send_reply(req, EVHTP_RES_OK);
+}
@@ -0,0 +1,23 @@
+#ifndef __BROWSE_H__
+#define __BROWSE_H__
+#include <stdint.h>
+#include <evhtp/evhtp.h>
+
+// /databases/N/browse/{artists,albums,genres,composers}, served from
+// sorted, deduplicated in-memory arrays of each field's values.  the 
+// writer marks fields changed as it commits; an array is rebuilt by the
+// first browse request that finds it older than its field.
+
+typedef enum browse_field {
+    B_ARTISTS = 0,
+    B_ALBUMS,
+    B_GENRES,
+    B_COMPOSERS,
+    B_MAX
+} browse_field;
+
+#define B_ALL ((1 << B_MAX) - 1)
+
+void browse_invalidate(int fields, uint64_t revision);
+void res_browse(evhtp_request_t *req, void *a);
+#endif
@@ -29,6 +29,23 @@ void get_config(config_t *config, char *cfg_file) {
         CFG_SIMPLE_BOOL("sequential",  &(config->sequential)),
         CFG_SIMPLE_INT("stripes",      &(config->cachestripes)),
         CFG_SIMPLE_INT("chunk-size",   &(config->chunksize)),
+        CFG_SIMPLE_INT("response-cache", &(config->respcache)),
+        CFG_SIMPLE_INT("listing-stream", &(config->liststream)),
+        CFG_SIMPLE_INT("listing-window", &(config->listwindow)),
+        CFG_SIMPLE_INT("statement-cache", &(config->stmtcache)),
+        CFG_SIMPLE_INT("gzip-level",   &(config->gziplevel)),
+        CFG_SIMPLE_INT("gzip-threshold", &(config->gzipmin)),
+        CFG_SIMPLE_STR("sendfile-networks", &(config->sendfile_nets)),
+        CFG_SIMPLE_INT("stream-lead",  &(config->streamlead)),
+        CFG_SIMPLE_INT("stream-burst", &(config->streamburst)),
+        CFG_SIMPLE_INT("stream-port",  &(config->streamport)),
+        CFG_SIMPLE_INT("stream-threads", &(config->streamthreads)),
+        CFG_SIMPLE_INT("stream-readers", &(config->streamreaders)),
+        CFG_SIMPLE_INT("prefetch-tracks", &(config->prefetchtracks)),
+        CFG_SIMPLE_INT("prefetch-size", &(config->prefetchsize)),
+        CFG_SIMPLE_INT("stream-cap",   &(config->streamcap)),
+        CFG_SIMPLE_INT("client-cap",   &(config->clientcap)),
+        CFG_SIMPLE_INT("egress-cap",   &(config->egresscap)),
 		CFG_SIMPLE_STR("name",         &(config->name)),
 		CFG_SIMPLE_STR("root",         &(config->root)),
 		CFG_SIMPLE_STR("dbfile",       &(config->dbfile)),
@@ -50,6 +67,22 @@ void get_config(config_t *config, char *cfg_file) {
     DEFAULT_INT(config->chunksize,     256*1024);
     DEFAULT_INT(config->chunkpreload,  config->chunksize * 4);
     DEFAULT_INT(config->chunkdelay,    config->chunksize / 8192);
+    DEFAULT_INT(config->respcache,     64);
+    DEFAULT_INT(config->liststream,    0);
+    DEFAULT_INT(config->listwindow,    64*1024);
+    DEFAULT_INT(config->stmtcache,     64);
+    DEFAULT_INT(config->gziplevel,     6);
+    DEFAULT_INT(config->gzipmin,       4096);
+    DEFAULT_INT(config->streamlead,    10);
+    DEFAULT_INT(config->streamburst,   4);
+    DEFAULT_INT(config->streamport,    0);
+    DEFAULT_INT(config->streamthreads, 2);
+    DEFAULT_INT(config->streamreaders, 0);
+    DEFAULT_INT(config->prefetchtracks, 2);
+    DEFAULT_INT(config->prefetchsize,  4);
+    DEFAULT_INT(config->streamcap,     0);
+    DEFAULT_INT(config->clientcap,     0);
+    DEFAULT_INT(config->egresscap,     0);
     DEFAULT_INT(config->verbose,    0);
 
         // DAAPPER_DBFILE
@@ -62,6 +95,8 @@ void get_config(config_t *config, char *cfg_file) {
     DEFAULT_STR(config->library_name, "Library");
 
     DEFAULT_STR(config->lock_style, "lock");
+        // none: every client gets paced chunks
+    DEFAULT_STR(config->sendfile_nets, "");
 
     char *cfg_path = cfg_file ? cfg_file : "/etc/daapper.conf";
     if (access(cfg_path, F_OK) != -1) {	
@@ -14,6 +14,22 @@ typedef struct config_t {
     long   chunksize;
     long   chunkpreload;
     long   chunkdelay;
+    long   respcache;
+    long   liststream;
+    long   listwindow;
+    long   stmtcache;
+    long   gziplevel;
+    long   gzipmin;
+    long   streamlead;    // seconds of audio a paced client is kept ahead
+    long   streamburst;   // seconds of audio sent before pacing starts
+    long   streamport;    // a listener of its own for song streams, or 0
+    long   streamthreads; // the event loops behind it
+    long   streamreaders; // threads reading chunks off the loops, or 0
+    long   prefetchtracks;// tracks warmed after the one playing, at most 8
+    long   prefetchsize;  // MB warmed of each
+    long   streamcap;     // KB/s a paced stream may take, or 0
+    long   clientcap;     // KB/s a client address may take, or 0
+    long   egresscap;     // KB/s all paced streams may take, or 0
     char *name;
     char *root;
     char *dbfile;
@@ -21,6 +37,7 @@ typedef struct config_t {
     char *library_name;
     char *userid;
     char *lock_style;
+    char *sendfile_nets;  // clients sent whole files, not paced chunks
 } config_t;
 
 extern config_t conf;
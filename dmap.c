@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <event2/buffer.h>
 #include <syslog.h>
@@ -74,3 +75,154 @@ void dmap_add_long(struct evbuffer *evbuf, const char *tag, const long l) {
 void dmap_add_date(struct evbuffer *evbuf, const char *tag, const int date) {
    dmap_add_int(evbuf, tag, date); 
 }
+
+struct _dmapbuf {
+	unsigned char *data;
+	size_t         len;
+	size_t         capacity;
+};
+
+static void _free_cb(const void *data, size_t len, void *extra) {
+	free((void *)data);
+}
+
+static unsigned char *_reserve(DMAPBUF *b, size_t n) {
+	if (b->len + n > b->capacity) {
+		size_t cap = b->capacity ? b->capacity : 512;
+		while (cap < b->len + n) cap *= 2;
+		b->data     = realloc(b->data, cap);
+		b->capacity = cap;
+	}
+	unsigned char *p = b->data + b->len;
+	b->len += n;
+	return p;
+}
+
+DMAPBUF *dmap_buf_new(size_t initial) {
+	DMAPBUF *b  = malloc(sizeof(DMAPBUF));
+	b->capacity = initial;
+	b->data     = initial ? malloc(initial) : NULL;
+	b->len      = 0;
+	return b;
+}
+
+void dmap_buf_free(DMAPBUF *b) {
+	if (b) {
+		free(b->data);
+		free(b);
+	}
+}
+
+size_t dmap_buf_length(DMAPBUF *b) {
+	return b->len;
+}
+
+/**
+ * @brief discard everything after len, e.g. an item that a callback 
+ *        decided not to keep.
+ */
+void dmap_buf_truncate(DMAPBUF *b, size_t len) {
+	if (len < b->len) b->len = len;
+}
+
+/**
+ * @brief take ownership of the encoded bytes, leaving the buffer empty.
+ *        the result must be released with free().
+ */
+unsigned char *dmap_buf_detach(DMAPBUF *b, size_t *len) {
+	unsigned char *result = b->data;
+	*len        = b->len;
+	b->data     = NULL;
+	b->len      = 0;
+	b->capacity = 0;
+	return result;
+}
+
+/**
+ * @brief hand the encoded bytes to an evbuffer without copying them.
+ *        the buffer is left empty.
+ */
+void dmap_buf_send(DMAPBUF *b, EVBUF *out) {
+	size_t len;
+	unsigned char *data = dmap_buf_detach(b, &len);
+	if (data)
+		evbuffer_add_reference(out, data, len, _free_cb, NULL);
+}
+
+/**
+ * @brief append bytes that are already encoded, e.g. an item encoded into 
+ *        another buffer.
+ */
+void dmap_buf_append(DMAPBUF *b, const void *data, size_t len) {
+	memcpy(_reserve(b, len), data, len);
+}
+
+void dmap_buf_char(DMAPBUF *b, const char *tag, const char ch) {
+	unsigned char *p = _reserve(b, 9);
+	memcpy(p, tag, 4);
+	ENCODE_UINT32(p + 4, 1);
+	p[8] = ch;
+}
+
+void dmap_buf_short(DMAPBUF *b, const char *tag, const short s) {
+	unsigned char *p = _reserve(b, 10);
+	memcpy(p, tag, 4);
+	ENCODE_UINT32(p + 4, 2);
+	p[8] = (s >> 8) & 0xff;
+	p[9] = s & 0xff;
+}
+
+/**
+ * @return the offset of the value, for a later dmap_buf_set_int()
+ */
+size_t dmap_buf_int(DMAPBUF *b, const char *tag, const int i) {
+	unsigned char *p = _reserve(b, 12);
+	memcpy(p, tag, 4);
+	ENCODE_UINT32(p + 4, 4);
+	ENCODE_UINT32(p + 8, i);
+	return b->len - 4;
+}
+
+void dmap_buf_long(DMAPBUF *b, const char *tag, const long l) {
+	unsigned char *p = _reserve(b, 16);
+	memcpy(p, tag, 4);
+	ENCODE_UINT32(p + 4, 8);
+	ENCODE_UINT64(p + 8, l);
+}
+
+void dmap_buf_string_n(DMAPBUF *b, const char *tag, 
+                       const char *str, size_t len) {
+	unsigned char *p = _reserve(b, 8 + len);
+	memcpy(p, tag, 4);
+	ENCODE_UINT32(p + 4, len);
+	if (len > 0)
+		memcpy(p + 8, str, len);
+}
+
+void dmap_buf_string(DMAPBUF *b, const char *tag, const char *str) {
+	dmap_buf_string_n(b, tag, str, str ? strlen(str) : 0);
+}
+
+void dmap_buf_date(DMAPBUF *b, const char *tag, const int date) {
+	dmap_buf_int(b, tag, date);
+}
+
+/**
+ * @brief start a container, its length is written by dmap_buf_close_list()
+ * @return the offset of the container, to pass to dmap_buf_close_list()
+ */
+size_t dmap_buf_open_list(DMAPBUF *b, const char *tag) {
+	size_t list = b->len;
+	unsigned char *p = _reserve(b, 8);
+	memcpy(p, tag, 4);
+	return list;
+}
+
+void dmap_buf_close_list(DMAPBUF *b, size_t list) {
+	size_t len = b->len - list - 8;
+	ENCODE_UINT32(b->data + list + 4, len);
+}
+
+void dmap_buf_set_int(DMAPBUF *b, size_t ofs, const int i) {
+	ENCODE_UINT32(b->data + ofs, i);
+}
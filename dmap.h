@@ -9,8 +9,10 @@
 #ifndef __DMAP_H__
 #define __DMAP_H__
 
+#include <stddef.h>
 #include <event2/buffer.h>
 typedef struct evbuffer EVBUF;
+typedef struct _dmapbuf DMAPBUF;
 typedef enum dmap_t {
     T_CHAR   = 1,
     T_SHORT  = 3,
@@ -29,4 +31,26 @@ void dmap_add_long  (EVBUF *evbuf, const char *tag, const long l) ;
 void dmap_add_string(EVBUF *evbuf, const char *tag, const char *str) ;
 void dmap_add_list  (EVBUF *evbuf, const char *tag, const int len) ;
 void dmap_add_date  (EVBUF *evbuf, const char *tag, const int date);
+
+// a single growable contiguous buffer that a whole response is encoded
+// into.  containers are opened at an offset and their length is patched
+// in place when they are closed, so nothing is encoded twice.
+DMAPBUF *dmap_buf_new       (size_t initial);
+void     dmap_buf_free      (DMAPBUF *b);
+size_t   dmap_buf_length    (DMAPBUF *b);
+void     dmap_buf_truncate  (DMAPBUF *b, size_t len);
+unsigned char *dmap_buf_detach(DMAPBUF *b, size_t *len);
+void     dmap_buf_send      (DMAPBUF *b, EVBUF *out);
+void     dmap_buf_append    (DMAPBUF *b, const void *data, size_t len);
+void     dmap_buf_char      (DMAPBUF *b, const char *tag, const char ch);
+void     dmap_buf_short     (DMAPBUF *b, const char *tag, const short s);
+size_t   dmap_buf_int       (DMAPBUF *b, const char *tag, const int i);
+void     dmap_buf_long      (DMAPBUF *b, const char *tag, const long l);
+void     dmap_buf_string    (DMAPBUF *b, const char *tag, const char *str);
+void     dmap_buf_string_n  (DMAPBUF *b, const char *tag, 
+                             const char *str, size_t len);
+void     dmap_buf_date      (DMAPBUF *b, const char *tag, const int date);
+size_t   dmap_buf_open_list (DMAPBUF *b, const char *tag);
+void     dmap_buf_close_list(DMAPBUF *b, size_t list);
+void     dmap_buf_set_int   (DMAPBUF *b, size_t ofs, const int i);
 #endif
@@ -0,0 +1,432 @@
+// DAAP query= filters over in-memory bitmap indexes.
+// For each indexed field the values of every song are kept sorted, each
+// with the run of song ids that have it, so that a term resolves to a
+// bitmap by binary search, or for a wildcard by a scan of the distinct
+// values rather than of the songs.  AND, OR and NOT are done a word at a
+// time.  Like the browse indexes, the index is immutable once built and
+// reference counted, and is rebuilt by the first request after a commit.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <evhtp/evhtp.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "util.h"
+#include "sql.h"
+#include "writer.h"
+#include "filter.h"
+
+#define FILTER_POINTER "daap_filter"  // the sqlite3_bind_pointer() type
+
+typedef struct posting {
+    const char *value;
+    long        first;      // into field_index.ids
+    long        n;
+} posting;
+
+typedef struct field_index {
+    long        n;
+    posting    *values;
+    int        *ids;
+} field_index;
+
+typedef struct filter_def {
+    const char *meta_tag;
+    int         col;        // in Q_FILTER_INDEX
+} filter_def;
+
+static const filter_def defs[] = {
+    { "dmap.itemid",         0 },
+    { "daap.songartist",     1 },
+    { "daap.songalbum",      2 },
+    { "daap.songgenre",      3 },
+    { "daap.songyear",       4 },
+    { "daap.songcodectype",  5 },
+    { "dmap.itemname",       6 },
+    { "daap.songalbumid",    7 },
+};
+#define F_MAX (int)(sizeof(defs) / sizeof(defs[0]))
+
+typedef struct filter_index {
+    volatile int  refs;
+    uint64_t      revision;
+    long          nwords;
+    uint64_t     *exists;   // the ids of all songs
+    field_index   fields[F_MAX];
+    char         *pool;
+} filter_index;
+
+struct _filter {
+    volatile int  refs;
+    long          nwords;
+    long          count;
+    uint64_t     *bits;
+};
+
+static filter_index    *current = NULL;
+static uint64_t         changed = 1;
+static pthread_mutex_t  filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  build_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+static void _release(filter_index *idx) {
+    if (idx && __sync_sub_and_fetch(&idx->refs, 1) == 0) {
+        for (int f = 0; f < F_MAX; f++) {
+            free(idx->fields[f].values);
+            free(idx->fields[f].ids);
+        }
+        free(idx->exists);
+        free(idx->pool);
+        free(idx);
+    }
+}
+
+typedef struct pair {
+    const char *value;
+    int         id;
+} pair;
+
+static int _compare(const void *a, const void *b) {
+    const pair *x = a, *y = b;
+    int c = strcasecmp(x->value, y->value);
+    return c ? c : x->id - y->id;
+}
+
+static filter_index *_build(app *aux, uint64_t revision) {
+    sqlite3_stmt *stmt = aux->stmts[Q_FILTER_INDEX];
+    size_t used = 0, size = 65536;
+    long n = 0, cap = 1024;
+    int maxid = 0;
+    char *pool = malloc(size);
+// offsets into the pool until it has stopped moving
+    size_t *ofs = malloc(cap * F_MAX * sizeof(size_t));
+    int *ids = malloc(cap * sizeof(int));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (n == cap) {
+            cap *= 2;
+            ofs = realloc(ofs, cap * F_MAX * sizeof(size_t));
+            ids = realloc(ids, cap * sizeof(int));
+        }
+        ids[n] = sqlite3_column_int(stmt, 0);
+        if (ids[n] > maxid) maxid = ids[n];
+        for (int f = 0; f < F_MAX; f++) {
+            const char *str = (const char *)sqlite3_column_text(stmt,
+                                                                defs[f].col);
+            size_t len = str ? sqlite3_column_bytes(stmt, defs[f].col) : 0;
+            while (used + len + 1 > size)
+                pool = realloc(pool, size *= 2);
+            memcpy(pool + used, str ? str : "", len);
+            pool[used + len] = '\0';
+            ofs[n * F_MAX + f] = used;
+            used += len + 1;
+        }
+        n++;
+    }
+    sqlite3_reset(stmt);
+    filter_index *idx = calloc(1, sizeof(filter_index));
+    idx->refs     = 1;  // the reference held by current
+    idx->revision = revision;
+    idx->pool     = pool;
+    idx->nwords   = maxid / 64 + 1;
+    idx->exists   = calloc(idx->nwords, sizeof(uint64_t));
+    for (long i = 0; i < n; i++)
+        idx->exists[ids[i] / 64] |= 1ULL << (ids[i] % 64);
+    pair *pairs = malloc((n ? n : 1) * sizeof(pair));
+    for (int f = 0; f < F_MAX; f++) {
+        field_index *fi = &idx->fields[f];
+        for (long i = 0; i < n; i++) {
+            pairs[i].value = pool + ofs[i * F_MAX + f];
+            pairs[i].id    = ids[i];
+        }
+        qsort(pairs, n, sizeof(pair), _compare);
+        fi->ids    = malloc((n ? n : 1) * sizeof(int));
+        fi->values = malloc((n ? n : 1) * sizeof(posting));
+        fi->n      = 0;
+// one posting per run of values equal but for case
+        for (long i = 0; i < n; i++) {
+            fi->ids[i] = pairs[i].id;
+            if (!fi->n || strcasecmp(fi->values[fi->n - 1].value,
+                                     pairs[i].value)) {
+                fi->values[fi->n].value = pairs[i].value;
+                fi->values[fi->n].first = i;
+                fi->values[fi->n].n     = 0;
+                fi->n++;
+            }
+            fi->values[fi->n - 1].n++;
+        }
+    }
+    free(pairs);
+    free(ofs);
+    free(ids);
+    LOGGER(LOG_INFO, "built filter index: %ld songs, %ld artists, "
+                     "%ld albums, %ld genres", n, idx->fields[1].n,
+                     idx->fields[2].n, idx->fields[3].n);
+    return idx;
+}
+
+/**
+ * @brief called by the writer as it commits: songs or the values they
+ *        refer to may have changed as of revision.
+ */
+void filter_invalidate(uint64_t revision) {
+    pthread_mutex_lock(&filter_mutex);
+    changed = revision;
+    pthread_mutex_unlock(&filter_mutex);
+}
+
+// the current index, rebuilding it first if it is stale
+static filter_index *_acquire(app *aux) {
+    filter_index *idx;
+    uint64_t revision;
+    pthread_mutex_lock(&build_mutex);
+    pthread_mutex_lock(&filter_mutex);
+    idx = current;
+    if (idx && idx->revision >= changed) {
+        __sync_add_and_fetch(&idx->refs, 1);
+        pthread_mutex_unlock(&filter_mutex);
+        pthread_mutex_unlock(&build_mutex);
+        return idx;
+    }
+    pthread_mutex_unlock(&filter_mutex);
+    revision = db_current_revision();
+    idx = _build(aux, revision);
+    __sync_add_and_fetch(&idx->refs, 1);  // the caller's reference
+    pthread_mutex_lock(&filter_mutex);
+    _release(current);
+    current = idx;
+    pthread_mutex_unlock(&filter_mutex);
+    pthread_mutex_unlock(&build_mutex);
+    return idx;
+}
+
+// case insensitive match of value against a pattern where '*' matches
+// any run of characters
+static int _wildmatch(const char *pat, const char *value) {
+    const char *star = NULL, *resume = NULL;
+    while (*value) {
+        if (*pat == '*') {
+            star = pat++;
+            resume = value;
+        } else if (tolower((unsigned char)*pat) ==
+                   tolower((unsigned char)*value)) {
+            pat++;
+            value++;
+        } else if (star) {
+            pat = star + 1;
+            value = ++resume;
+        } else
+            return 0;
+    }
+    while (*pat == '*') pat++;
+    return !*pat;
+}
+
+typedef struct parser {
+    filter_index *idx;
+    const char   *p;
+    int           error;
+} parser;
+
+static void _add_posting(filter_index *idx, field_index *fi,
+                         posting *post, uint64_t *bits) {
+    for (long i = post->first; i < post->first + post->n; i++)
+        bits[fi->ids[i] / 64] |= 1ULL << (fi->ids[i] % 64);
+}
+
+// the songs matching one 'field:value' or 'field!:value' term
+static uint64_t *_term(parser *ps, const char *field, const char *value,
+                       int negate) {
+    filter_index *idx = ps->idx;
+    uint64_t *bits = calloc(idx->nwords, sizeof(uint64_t));
+    int f;
+    for (f = 0; f < F_MAX; f++)
+        if (!strcmp(field, defs[f].meta_tag)) break;
+    if (f == F_MAX) {
+// a field that isn't indexed doesn't narrow the listing
+        LOGGER(LOG_DEBUG, "ignoring filter on '%s'", field);
+        memcpy(bits, idx->exists, idx->nwords * sizeof(uint64_t));
+        return bits;
+    }
+    field_index *fi = &idx->fields[f];
+    if (strchr(value, '*')) {
+        for (long i = 0; i < fi->n; i++)
+            if (_wildmatch(value, fi->values[i].value))
+                _add_posting(idx, fi, &fi->values[i], bits);
+    } else {
+        long lo = 0, hi = fi->n;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (strcasecmp(fi->values[mid].value, value) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < fi->n && !strcasecmp(fi->values[lo].value, value))
+            _add_posting(idx, fi, &fi->values[lo], bits);
+    }
+    if (negate)
+        for (long w = 0; w < idx->nwords; w++)
+            bits[w] = idx->exists[w] & ~bits[w];
+    return bits;
+}
+
+static uint64_t *_expr(parser *ps);
+
+static void _space(parser *ps) {
+    while (*ps->p == ' ' || *ps->p == '+') ps->p++;
+}
+
+// a quoted term or a parenthesized expression
+static uint64_t *_crit(parser *ps) {
+    _space(ps);
+    if (*ps->p == '(') {
+        ps->p++;
+        uint64_t *bits = _expr(ps);
+        _space(ps);
+        if (*ps->p != ')') ps->error = 1;
+        else ps->p++;
+        return bits;
+    }
+    char quote = *ps->p;
+    if (quote != '\'' && quote != '"') {
+        ps->error = 1;
+        return calloc(ps->idx->nwords, sizeof(uint64_t));
+    }
+    ps->p++;
+    char *term = malloc(strlen(ps->p) + 1), *t = term;
+    while (*ps->p && *ps->p != quote) {
+        if (*ps->p == '\\' && ps->p[1]) ps->p++;
+        *t++ = *ps->p++;
+    }
+    *t = '\0';
+    if (*ps->p == quote) ps->p++;
+    else ps->error = 1;
+    int negate = 0;
+    char *value = strchr(term, ':');
+    if (!value) {
+        ps->error = 1;
+        value = t;
+    } else {
+        if (value > term && value[-1] == '!') {
+            negate = 1;
+            value[-1] = '\0';
+        }
+        *value++ = '\0';
+    }
+    uint64_t *bits = _term(ps, term, value, negate);
+    free(term);
+    return bits;
+}
+
+// terms separated by '+' or ' ' are ANDed, and bind tighter than ','
+static uint64_t *_and(parser *ps) {
+    uint64_t *bits = _crit(ps);
+    for (;;) {
+        _space(ps);
+        if (ps->error || (*ps->p != '\'' && *ps->p != '"' && *ps->p != '('))
+            return bits;
+        uint64_t *rhs = _crit(ps);
+        for (long w = 0; w < ps->idx->nwords; w++)
+            bits[w] &= rhs[w];
+        free(rhs);
+    }
+}
+
+static uint64_t *_expr(parser *ps) {
+    uint64_t *bits = _and(ps);
+    for (;;) {
+        _space(ps);
+        if (ps->error || *ps->p != ',')
+            return bits;
+        ps->p++;
+        uint64_t *rhs = _and(ps);
+        for (long w = 0; w < ps->idx->nwords; w++)
+            bits[w] |= rhs[w];
+        free(rhs);
+    }
+}
+
+// daap_match(id, :filter) is true if the bound filter has the song
+static void _match(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    FILTER *f = sqlite3_value_pointer(argv[1], FILTER_POINTER);
+    sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+    if (!f) {
+        sqlite3_result_int(ctx, 1);
+        return;
+    }
+    sqlite3_result_int(ctx, id >= 0 && id / 64 < f->nwords &&
+                            (f->bits[id / 64] >> (id % 64)) & 1);
+}
+
+void filter_register(app *aux) {
+    if (sqlite3_create_function_v2(aux->db, "daap_match", 2, SQLITE_UTF8,
+                                   NULL, _match, NULL, NULL, NULL)
+        != SQLITE_OK)
+        LOGGER(LOG_ERR, "can't register daap_match(): %s",
+                        sqlite3_errmsg(aux->db));
+}
+
+/**
+ * @brief evaluate a url encoded query= expression to the set of songs it
+ *        matches.
+ * @return the filter, or NULL if the expression can't be parsed
+ */
+FILTER *filter_compile(app *aux, const char *query) {
+    size_t qlen = strlen(query);
+    unsigned char *expr = calloc(qlen + 1, 1);
+    if (evhtp_unescape_string(&expr, (unsigned char *)query, qlen) != 0) {
+        free(expr);
+        return NULL;
+    }
+    parser ps;
+    ps.idx   = _acquire(aux);
+    ps.p     = (const char *)expr;
+    ps.error = 0;
+    uint64_t *bits = _expr(&ps);
+    _space(&ps);
+    if (ps.error || *ps.p) {
+        LOGGER(LOG_ERR, "can't parse query '%s'", (char *)expr);
+        free(bits);
+        free(expr);
+        _release(ps.idx);
+        return NULL;
+    }
+    FILTER *f = malloc(sizeof(FILTER));
+    f->refs   = 1;
+    f->nwords = ps.idx->nwords;
+    f->bits   = bits;
+    f->count  = 0;
+    for (long w = 0; w < f->nwords; w++)
+        f->count += __builtin_popcountll(bits[w] &= ps.idx->exists[w]);
+    LOGGER(LOG_INFO, "query '%s' matches %ld songs", (char *)expr, f->count);
+    free(expr);
+    _release(ps.idx);
+    return f;
+}
+
+FILTER *filter_ref(FILTER *f) {
+    __sync_add_and_fetch(&f->refs, 1);
+    return f;
+}
+
+void filter_release(FILTER *f) {
+    if (f && __sync_sub_and_fetch(&f->refs, 1) == 0) {
+        free(f->bits);
+        free(f);
+    }
+}
+
+long filter_count(FILTER *f) {
+    return f->count;
+}
+
+/**
+ * @brief bind f to the :filter parameter of stmt, if it has one.  f must
+ *        outlive the statement's use.
+ */
+void filter_bind(FILTER *f, sqlite3_stmt *stmt) {
+    int i = sqlite3_bind_parameter_index(stmt, ":filter");
+    if (i)
+        sqlite3_bind_pointer(stmt, i, f, FILTER_POINTER, NULL);
+}
@@ -0,0 +1,22 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+#include <stdint.h>
+#include "util.h"
+
+// DAAP query= filters, such as 'daap.songartist:Foo'+'daap.songgenre:Rock',
+// evaluated to a bitmap of song ids against in-memory indexes of the 
+// artist, album, genre, year and codec of every song.  listing queries 
+// test it with daap_match(s.id, :filter).
+
+typedef struct _filter FILTER;
+
+#define FILTER_CLAUSE "AND daap_match(s.id, :filter)"
+
+void    filter_register  (app *aux);
+void    filter_invalidate(uint64_t revision);
+FILTER *filter_compile   (app *aux, const char *query);
+FILTER *filter_ref       (FILTER *f);
+void    filter_release   (FILTER *f);
+long    filter_count     (FILTER *f);
+void    filter_bind      (FILTER *f, sqlite3_stmt *stmt);
+#endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -21,11 +22,26 @@
 #include "writer.h"
 #include "scratch.h"
 #include "stream.h"
+#include "respcache.h"
+#include "listing.h"
+#include "plan.h"
+#include "browse.h"
+#include "filter.h"
+#include "longpoll.h"
+#include "reader.h"
+#include "bandwidth.h"
+#include "keyset.h"
+#include "sortkeys.h"
 
 static const int  current_rev = 2;
 
 #define DB_STR  "^/databases/"
 #define REG_NUM "([0-9]+)"
+#define RESPONSE_KEY_SIZE 512
+// the songs of a delta listing, see the changes table
+#define DELTA_CLAUSE \
+    "AND s.id IN (SELECT song FROM changes WHERE deleted = 0 " \
+    "AND revision > :since AND revision <= :until)"
 
 const char *server_name = "LULU";
 const char *library_name = "Robert";
@@ -48,6 +64,13 @@ void app_init_thread(evhtp_t *htp, evthr_t *thread, void *arg) {
     app_parent *parent = (app_parent *)arg;
     app *aux = malloc(sizeof(app));
     aux->header = -1;        
+    aux->spare     = NULL;
+    aux->owner     = NULL;
+    aux->plans     = NULL;
+    aux->filter    = NULL;
+    aux->range     = NULL;
+    aux->since     = 0;
+    aux->reader    = NULL;
     pthread_mutex_lock(&threads_mutex);
     aux->thread_id = ++threads;
     pthread_mutex_unlock(&threads_mutex);
@@ -59,6 +82,12 @@ void app_init_thread(evhtp_t *htp, evthr_t *thread, void *arg) {
     wait_for_writer();
     db_open_database(aux, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_SHAREDCACHE);
     precompile_statements(aux);
+    filter_register(aux);
+    longpoll_init_thread(aux);
+    stream_init_thread(aux);
+    bw_init_thread(aux);
+    if (conf.streamreaders > 0)
+        reader_init_thread(aux);
 // to be retrieved by request callbacks that need
     evthr_set_aux(thread, aux); 
     LOGGER(LOG_INFO, "evhtp thread listening for connections.");
@@ -66,6 +95,12 @@ void app_init_thread(evhtp_t *htp, evthr_t *thread, void *arg) {
 
 void app_term_thread(evhtp_t *htp, evthr_t *thread, void *arg) {
     app *aux = (app *)evthr_get_aux(thread);
+    longpoll_term_thread(aux);
+    listing_term_thread(aux);
+    stream_term_thread(aux);
+    bw_term_thread(aux);
+    reader_term_thread(aux);
+    plan_free_all(aux);
     db_close_database(aux);
     free(aux);
     LOGGER(LOG_INFO, "evhtp thread terminated.");
@@ -113,6 +148,290 @@ void add_list(struct evbuffer *out, struct evbuffer *payload,
     evbuffer_add_buffer(out, payload);
 }
 
+/**
+ * @brief build the response cache key for a listing: the endpoint, the
+ *        container it lists, the resolved meta tags in request order, and
+ *        the query= filter and index= range as sent, if any, and the
+ *        sort order.  without tags and index, it names the rows listed, 
+ *        see page_listing().
+ * @return key, or NULL if it doesn't fit and the response can't be cached
+ */
+static const char *response_key(char *key, size_t size, const char *endpoint,
+                                int id, vector *tags, const char *filter,
+                                const char *index, q_sort sort) {
+    size_t pos = snprintf(key, size, "%s/%d", endpoint, id);
+    for (int i = 0; tags && i < tags->used && pos < size; i++) {
+        meta_tag_t *tag = tags->data[i];
+        pos += snprintf(key + pos, size - pos, ",%s", tag->tag);
+    }
+    if (filter && pos < size)
+        pos += snprintf(key + pos, size - pos, "?%s", filter);
+    if (index && pos < size)
+        pos += snprintf(key + pos, size - pos, "#%s", index);
+    if (sort != S_NONE && pos < size)
+        pos += snprintf(key + pos, size - pos, "~%d", sort);
+    return pos < size ? key : NULL;
+}
+
+/**
+ * @brief whether the reply to req may be gzipped: it's enabled, and the 
+ *        client's Accept-Encoding lists gzip, or failing that *, with a
+ *        q above 0.
+ */
+static int accepts_gzip(evhtp_request_t *req) {
+    if (conf.gziplevel <= 0) return 0;
+    const char *p = evhtp_kv_find(req->headers_in, "Accept-Encoding");
+    int any = 0;
+    while (p && *p) {
+        p += strspn(p, " \t,");
+        const char *name = p;
+        size_t len = strcspn(p, " \t;,");
+        double q = 1;
+        p += len;
+// the token's parameters, of which only q matters
+        while (*p && *p != ',') {
+            p += strspn(p, " \t;");
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                q = strtod(p + 2, NULL);
+            p += strcspn(p, ";,");
+        }
+        if ((len == 4 && !strncasecmp(name, "gzip", 4)) ||
+            (len == 6 && !strncasecmp(name, "x-gzip", 6)))
+            return q > 0;
+        if (len == 1 && *name == '*')
+            any = q > 0;
+    }
+    return any;
+}
+
+// a strong validator for a listing: the revision it was built at and a
+// hash of its response key.  the gzipped bytes are a different entity.
+static void listing_etag(char *etag, size_t size, const char *key, 
+                         uint64_t rev, int gzip) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211ULL;
+    }
+    snprintf(etag, size, "\"%llx-%016llx%s\"", (unsigned long long)rev, 
+             (unsigned long long)h, gzip ? "-gz" : "");
+}
+
+/**
+ * @brief if req's If-None-Match names the listing under key as it would 
+ *        be sent now, reply 304 without building it.  the 304 carries the
+ *        ETag matched, or for * that of the variant a 200 would send.
+ * @return 1 if the reply was sent
+ */
+static int not_modified(evhtp_request_t *req, const char *key, 
+                        uint64_t rev) {
+    char etag[64];
+    const char *match = evhtp_kv_find(req->headers_in, "If-None-Match");
+    if (!match || !key) return 0;
+    int gzip = accepts_gzip(req);
+    listing_etag(etag, sizeof(etag), key, rev, 0);
+    int hit = strstr(match, etag) != NULL;
+    if (!hit && gzip) {
+        listing_etag(etag, sizeof(etag), key, rev, 1);
+        hit = strstr(match, etag) != NULL;
+    }
+    if (!hit && !strcmp(match, "*")) {
+// a listing that isn't cached is taken to be worth gzipping
+        if (gzip && respcache_gzipped(key, rev) == 0)
+            gzip = 0;
+        listing_etag(etag, sizeof(etag), key, rev, gzip);
+        hit = 1;
+    }
+    if (!hit) return 0;
+    if (conf.gziplevel > 0)
+        evhtp_headers_add_header(req->headers_out,
+              evhtp_header_new("Vary", "Accept-Encoding", 0, 0));
+    evhtp_headers_add_header(req->headers_out,
+          evhtp_header_new("ETag", etag, 0, 1));
+    evhtp_send_reply(req, EVHTP_RES_NOTMOD);
+    LOGGER(LOG_INFO, "%s not modified.", key);
+    return 1;
+}
+
+// the headers for a listing reply, once respcache has said if it's gzipped
+static void add_listing_headers(evhtp_request_t *req, const char *key,
+                                uint64_t rev, int gzip) {
+    char etag[64];
+    if (conf.gziplevel > 0)
+        evhtp_headers_add_header(req->headers_out,
+              evhtp_header_new("Vary", "Accept-Encoding", 0, 0));
+    if (gzip)
+        evhtp_headers_add_header(req->headers_out,
+              evhtp_header_new("Content-Encoding", "gzip", 0, 0));
+    if (key) {
+        listing_etag(etag, sizeof(etag), key, rev, gzip);
+        evhtp_headers_add_header(req->headers_out,
+              evhtp_header_new("ETag", etag, 0, 1));
+    }
+}
+
+typedef struct listing_t {
+    size_t list, mtco, mrco, mlcl;
+    const int *deleted;   // the mudl ids of a delta listing, or NULL
+    int ndeleted;
+} listing_t;
+
+/**
+ * @brief start a listing response in out.  the counts and lengths are 
+ *        patched in by list_close() once the items have been encoded.
+ */
+static void list_open(DMAPBUF *out, char *code, listing_t *l) {
+    l->deleted  = NULL;
+    l->ndeleted = 0;
+    l->list = dmap_buf_open_list(out, code);
+    dmap_buf_int (out, "mstt", 200);
+    dmap_buf_char(out, "muty", 0);
+    l->mtco = dmap_buf_int(out, "mtco", 0);
+    l->mrco = dmap_buf_int(out, "mrco", 0);
+    l->mlcl = dmap_buf_open_list(out, "mlcl");
+}
+
+static void list_close(DMAPBUF *out, listing_t *l, int mtco, int mrco) {
+    dmap_buf_close_list(out, l->mlcl);
+    listing_put_deleted(out, l->deleted, l->ndeleted);
+    dmap_buf_set_int(out, l->mtco, mtco);
+    dmap_buf_set_int(out, l->mrco, mrco);
+    dmap_buf_close_list(out, l->list);
+}
+
+/**
+ * @brief encode the items listing of sqlstr into out, or if listing
+ *        streaming is on and the listing is at least that many bytes, 
+ *        start a chunked reply for it instead.  a delta listing passes
+ *        the ids deleted since the client's revision, NULL otherwise.
+ *        streamed listings are never gzipped.  total is the mtco of a
+ *        paged listing, or -1 if the listing is whole.  a sorted listing
+ *        passes its permutation, and its index= if any, which it applies
+ *        itself; it is never streamed.  a listing that fails is answered
+ *        with a 500 and isn't cached.
+ * @return 1 if the reply was started, else 0 and the caller sends it
+ */
+static int put_items(evhtp_request_t *req, app *aux, char *code, 
+                     plan_t *plan, const char *sqlstr, int *bindvar,
+                     int total, const int *deleted, int ndeleted,
+                     SORTKEYS *order, const char *index,
+                     const char *key, uint64_t rev, int *gzip) {
+    size_t size = 100000;
+    int nitems;
+    app *snap = NULL;
+    if (conf.liststream > 0 && !order) {
+        snap = listing_snapshot_begin(aux);
+        size = sql_size_results(snap, plan, sqlstr, bindvar, &nitems);
+        if (size >= conf.liststream) {
+            add_listing_headers(req, key, rev, 0);
+            listing_stream(req, snap, code, plan, sqlstr, bindvar, size, 
+                           nitems, total < 0 ? nitems : total,
+                           deleted, ndeleted);
+            return 1;
+        }
+// list header and the exact size of the items
+        size += 61 + listing_deleted_size(deleted, ndeleted);
+    }
+    DMAPBUF *body = dmap_buf_new(size);
+    listing_t list;
+    list_open(body, code, &list);
+    list.deleted  = deleted;
+    list.ndeleted = ndeleted;
+    if (order)
+        nitems = sortkeys_put_results(body, aux, plan, sqlstr, bindvar, 
+                                      order, index, &total);
+    else
+        nitems = sql_put_results(body, snap ? snap : aux, plan, sqlstr, 
+                                 bindvar, NULL);
+    if (snap) 
+        listing_snapshot_end(snap);
+    if (nitems < 0) {
+        LOGGER(LOG_ERR, "failed to list items for %s", key);
+        dmap_buf_free(body);
+        evhtp_send_reply(req, EVHTP_RES_ERROR);
+        return 1;
+    }
+    list_close(body, &list, total < 0 ? nitems : total, nitems);
+    respcache_store(req->buffer_out, key, rev, body, gzip);
+    LOGGER(LOG_INFO, "found %d items.", nitems);
+    dmap_buf_free(body);
+    return 0;
+}
+
+/**
+ * @brief the SELECT of a listing with the given clauses, selecting the
+ *        song id after the plan's columns if it is sorted.
+ */
+static void build_listing(query_t *q, plan_t *plan, SORTKEYS *order,
+                          vector *clauses, char **sqlstr) {
+    if (!order) {
+        sql_build_query_columns(q, plan->columns, clauses, sqlstr);
+        return;
+    }
+    char *columns = malloc(strlen(plan->columns) + 
+                           sizeof(SORTKEYS_COLUMN));
+    strcpy(columns, plan->columns);
+    strcat(columns, SORTKEYS_COLUMN);
+    sql_build_query_columns(q, columns, clauses, sqlstr);
+    free(columns);
+}
+
+typedef struct listing_keys_t {
+    const char *columns;    // the key, then the name if ordered by it first
+    int         named;
+    const char *range;      // selects the rows from :lo to :hi
+    const char *order;
+} listing_keys_t;
+
+static const listing_keys_t item_keys = {
+    "s.id", 0, "AND s.id BETWEEN :lo AND :hi", "ORDER BY s.id"
+};
+static const listing_keys_t playlist_item_keys = {
+    "pi.id", 0, "AND pi.id BETWEEN :lo AND :hi", "ORDER BY pi.id"
+};
+static const listing_keys_t group_keys = {
+    "g.id, COALESCE(g.name, '')", 1, 
+    "AND (COALESCE(g.name, ''), g.id) BETWEEN (:lo_name, :lo) "
+    "AND (:hi_name, :hi)",
+    GROUPLIST_ORDER
+};
+
+/**
+ * @brief if index is set, finish the clauses of a listing query with the
+ *        range of rows it selects and their order.  name identifies the
+ *        rows listed, whatever the meta tags, or is NULL.
+ * @return the keyset the range was resolved in, with aux->range set to 
+ *         range and *total to the rows in the whole listing, or NULL if
+ *         the listing isn't paged.  sql_open_results() binds the range 
+ *         until the keyset is released and aux->range cleared.
+ */
+static KEYSET *page_listing(app *aux, q_type type, vector *clauses, 
+                            const listing_keys_t *keys, const char *index,
+                            const char *name, int *bindvar, 
+                            keyrange_t *range, int *total) {
+    if (!index) 
+        return NULL;
+    query_t q;
+    char *sqlstr;
+    q.type = type;
+    vector_pushback(clauses, keys->order);
+    sql_build_query_columns(&q, keys->columns, clauses, &sqlstr);
+    KEYSET *ks = keyset_get(aux, name, sqlstr, bindvar, keys->named);
+    free(sqlstr);
+    clauses->data[clauses->used - 1] = (void *)keys->range;
+    vector_pushback(clauses, keys->order);
+    *total = keyset_count(ks);
+    long n = keyset_range(ks, index, range);
+    aux->range = range;
+    LOGGER(LOG_INFO, "index %s: %ld of %d rows", index, n, *total);
+    return ks;
+}
+
+static void page_done(app *aux, KEYSET *ks) {
+    aux->range = NULL;
+    keyset_release(ks);
+}
+
 void res_login(evhtp_request_t *req, void *a) {
     log_request(req, a);
     add_headers_out(req);
@@ -140,31 +459,22 @@ void res_logout(evhtp_request_t *req, void *a) {
     evhtp_send_reply(req, EVHTP_RES_NOCONTENT);
 }
 
-struct update_t {
-    evhtp_request_t *req;
-    int session_id;
-};
-
-void update_timer_cb(int fd, short event, void *a) { }
-
 void res_update(evhtp_request_t *req, void *a) {
     log_request(req, a);
     add_headers_out(req);
     ADD_DATE_HEADER("Date");
+    evthr_t *thread = get_request_thr(req);
+    app *aux = (app *)evthr_get_aux(thread);
     const char *s_str  = evhtp_kv_find(req->uri->query, "session-id");
     int s = s_str ? atoi(s_str) : -1;
     const char *rev_no = evhtp_kv_find(req->uri->query, "revision-number");
     int rev = rev_no ? atoi(rev_no) : 1;
-    if (rev == 1) {
-        dmap_add_list(req->buffer_out, "mupd", 24);
-        dmap_add_int (req->buffer_out, "mstt", 200);
-        dmap_add_int (req->buffer_out, "musr", 2 /*current_rev*/);  // 2
-        evhtp_send_reply(req, EVHTP_RES_OK);
-    }
-    // revision-number: 2+ is left open until a change occurs on the db
-    // since the db is currently read-only, this will never close unless 
-    // client disconnects
-//  evhtp_request_pause(req);
+    uint64_t current = db_current_revision();
+// revision-number: 2+ is left open until the library moves past it
+    if (rev > 1 && rev >= current && aux->longpoll)
+        longpoll_park(req, aux, s, rev);
+    else
+        longpoll_reply(req, current);
 }
 
 void res_database_list(evhtp_request_t *req, void *a) {
@@ -174,6 +484,9 @@ void res_database_list(evhtp_request_t *req, void *a) {
     evhtp_query_t *query = req->uri->query;
     evthr_t *thread = get_request_thr(req);
     app *aux = (app *)evthr_get_aux(thread);
+    uint64_t rev = db_current_revision();
+    if (not_modified(req, "avdb", rev))
+        return;
     int library_size   = count_precompiled_items(aux, 
                          Q_COUNT_ALL_SONGS, NULL);
     int playlist_count = count_precompiled_items(aux, 
@@ -211,6 +524,7 @@ void res_database_list(evhtp_request_t *req, void *a) {
     evbuffer_add_buffer(payload, item);
     evbuffer_free(item);
     add_list(req->buffer_out, payload, "avdb", 2, 2);
+    add_listing_headers(req, "avdb", rev, 0);
     evhtp_send_reply(req, EVHTP_RES_OK);
     evbuffer_free(payload);
 }
@@ -219,38 +533,27 @@ void res_database_list(evhtp_request_t *req, void *a) {
  * @brief callback for each item added
  * @return 1 if the item is to be added, or 0 if it is to be skipped.
  */
-int containerlist_itemcb(app *aux, struct evbuffer *item, meta_info_t *info) {
+int containerlist_itemcb(app *aux, DMAPBUF *item, meta_info_t *info) {
         sqlite3 *db = aux->db;
         if (info->id != 1) {
             if (info->kind == PL_SPECIAL || info->kind == PL_SMART) 
-                dmap_add_char(item, "aeSP", 1); // special playlist
+                dmap_buf_char(item, "aeSP", 1); // special playlist
             else
-                dmap_add_char(item, "aeSP", 0);
+                dmap_buf_char(item, "aeSP", 0);
             if (info->kind == PL_SMART)
-                dmap_add_char(item, "aePS", 1); // smart playlist
+                dmap_buf_char(item, "aePS", 1); // smart playlist
             else
-                dmap_add_char(item, "aePS", 0);
+                dmap_buf_char(item, "aePS", 0);
         }
-        dmap_add_char(item, "aePP", 0); // podcast
-        dmap_add_char(item, "aeSG", 0); // "saved genius"
-        int qty;    
-        char *query_str = (char *)get_smart_playlist_query(aux, info->id);
-        vector clauses;
-        vector_new(&clauses, 2);  // "where" and query
-        if (strcmp(query_str, "(NULL)")) {
-            vector_pushback(&clauses, "WHERE");
-            vector_pushback(&clauses, query_str); // the playlist's query string
-            qty = count_smart_items(aux, T_SONGS, &clauses, NULL);
-        } else 
-            qty = count_precompiled_items(aux, Q_COUNT_PL_ITEMS, &info->id);
-        vector_free(&clauses);
-        free(query_str);
-        dmap_add_int(item, "mimc", qty);
+        dmap_buf_char(item, "aePP", 0); // podcast
+        dmap_buf_char(item, "aeSG", 0); // "saved genius"
+// maintained by the writer, see update_smart_counts()
+        dmap_buf_int(item, "mimc", info->item_count);
         if (info->id == 1)  { // first playlist is "base" playlist
-            dmap_add_char (item, "abpl", 1);
-            dmap_add_int  (item, "mpco", 0); // parentcontainerid
+            dmap_buf_char (item, "abpl", 1);
+            dmap_buf_int  (item, "mpco", 0); // parentcontainerid
         } else
-            dmap_add_int  (item, "mpco", 1);
+            dmap_buf_int  (item, "mpco", 1);
         return 1; // (qty > 0 || info->kind != PL_SPECIAL);
 }
 
@@ -261,54 +564,40 @@ void res_container_list(evhtp_request_t *req, void *a) {
     evhtp_query_t *query = req->uri->query;
     evthr_t *thread = get_request_thr(req);
     app *aux = (app *)evthr_get_aux(thread);
-    query_t q;
-    int len;
-    char **meta = NULL;
-    char *raw_meta = NULL;
-    int nmeta = 0;
     const char *param = evhtp_kv_find(query, "meta");
-    int npl = count_precompiled_items(aux, Q_COUNT_ALL_PLAYLISTS, NULL);
-    LOGGER(LOG_INFO, "Found %d playlists.", npl);
-    if (param == NULL) {
-        meta  = (char **)default_meta_container;
-    } else {
-        raw_meta = strdup(param);
-        meta_parse(raw_meta, &meta, &nmeta); 
+    plan_t *plan = plan_get(aux, PLAN_CONTAINERS, param);
+    char key[RESPONSE_KEY_SIZE];
+    uint64_t rev = db_current_revision();
+    const char *k = response_key(key, sizeof(key), "aply", 0, &plan->tags, 
+                                 NULL, NULL, S_NONE);
+    if (not_modified(req, k, rev)) {
+        plan_release(plan);
+        return;
     }
-    vector tags;
-    vector_new(&tags, 20);
-// to be able to tell if a playlist is "smart", we need at least this meta
-// tag, so if the client specifies metatags we need to make sure this is there
-//if (param && strstr(raw_meta, "dmap.itemkind") == NULL)   
-    vector_pushback(&tags, container_meta_tags); // dmap.itemkind == 0 index
-    int i = -1;
-    while (meta[++i]) {
-        int index = meta_find_container_tag(meta[i]);
-        if (index >= 0)
-            vector_pushback(&tags, container_meta_tags + index);
-        else LOGGER(LOG_NOTICE, "unrecognized metatag: %s", meta[i]);
+    int gzip = accepts_gzip(req);
+    if (respcache_send(req->buffer_out, k, rev, &gzip)) {
+        LOGGER(LOG_INFO, "sent cached %s.", k);
+    } else {
+        DMAPBUF *body = dmap_buf_new(4096);
+        listing_t list;
+        list_open(body, "aply", &list);
+        int nitems = sql_put_results(body, aux, plan, plan->select, 
+                                     NULL, containerlist_itemcb); 
+        if (nitems < 0) {
+            LOGGER(LOG_ERR, "failed to list playlists");
+            dmap_buf_free(body);
+            evhtp_send_reply(req, EVHTP_RES_ERROR);
+            plan_release(plan);
+            return;
+        }
+        list_close(body, &list, nitems, nitems);
+        respcache_store(req->buffer_out, k, rev, body, &gzip);
+        LOGGER(LOG_INFO, "sent %d playlists.", nitems);
+        dmap_buf_free(body);
     }
-    char *sqlstr;
-    q.type = Q_CONTAINERLIST;
-    struct evbuffer *item, *payload;
-    payload = evbuffer_new();
-    sql_build_query(&q, &tags, NULL, &sqlstr);
-    int nitems = 0, ret;
-    nitems = count_precompiled_items(aux, Q_COUNT_ALL_PLAYLISTS, NULL); 
-    struct evbuffer **items = malloc (nitems * sizeof(struct evbuffer *));
-    ret = sql_put_results(&payload, items, aux, &tags, 1, 
-                          sqlstr, NULL, containerlist_itemcb); 
-    add_list(req->buffer_out, payload, "aply", nitems, nitems);
+    add_listing_headers(req, k, rev, gzip);
     evhtp_send_reply(req, EVHTP_RES_OK);
-    LOGGER(LOG_INFO, "sent %d playlists.", nitems);
-    // cleanup
-    if (raw_meta) free(raw_meta);
-    if (meta && meta != (char **)default_meta_container) free(meta);
-    vector_free(&tags);
-    free(sqlstr);
-    for (int n = 0; n < nitems; n++) evbuffer_free(items[n]);
-    free(items);
-    evbuffer_free(payload);
+    plan_release(plan);
 }
 
 /**
@@ -323,78 +612,78 @@ void res_container_items(evhtp_request_t *req, void *a) {
     evthr_t *thread = get_request_thr(req);
     app *aux = (app *)evthr_get_aux(thread);
     query_t q;
-    int len;
     const char *path = req->uri->path->path;
     int pl_num = uri_get_number(path, 1);
     const char *param = evhtp_kv_find(query, "meta");
-    char *raw_meta;
-    char **meta;
-    int nmeta;
-    if (param) {
-        raw_meta = strdup(param);
-        meta_parse(raw_meta, &meta, &nmeta); 
-    }
-    else {
-        raw_meta = NULL;
-        meta = (char **)default_meta_items;
+    const char *filter = evhtp_kv_find(query, "query");
+    const char *index  = evhtp_kv_find(query, "index");
+    q_sort sort = sortkeys_parse(evhtp_kv_find(query, "sort"));
+    plan_t *plan = plan_get(aux, PLAN_ITEMS, param);
+    char key[RESPONSE_KEY_SIZE], rows[RESPONSE_KEY_SIZE];
+    int streamed = 0;
+    uint64_t rev = db_current_revision();
+    const char *k = response_key(key, sizeof(key), "apso", pl_num, 
+                                 &plan->tags, filter, index, sort);
+    if (not_modified(req, k, rev)) {
+        plan_release(plan);
+        return;
     }
-    vector tags;
-    vector_new(&tags, 2);
-    int i = -1;
-    while (meta[++i]) {
-        int index = meta_find_item_tag(meta[i]);
-        if (index >= 0)
-            vector_pushback(&tags, item_meta_tags + index);
-        else LOGGER(LOG_NOTICE, "unrecognized metatag: %s", meta[i]);
-    }
-    char *sqlstr;
-    size_t nitems;
-    vector clauses;
-    vector_new(&clauses, 2); // "WHERE" and "ORDER" clauses
-    char *query_str = (char *)get_smart_playlist_query(aux, pl_num);
-    if (strcmp(query_str, "(NULL)")) {
-        q.type = Q_ITEMLIST;
-        vector_pushback(&clauses, "WHERE");
-        vector_pushback(&clauses, query_str); 
-        // the playlist's query string
-        sql_build_query(&q, &tags, &clauses, &sqlstr);
-        nitems = count_smart_items(aux, T_SONGS, &clauses, NULL);
+    int gzip = accepts_gzip(req);
+    if (respcache_send(req->buffer_out, k, rev, &gzip)) {
+        LOGGER(LOG_INFO, "sent cached %s.", k);
     } else {
-        q.type = Q_CONTAINERITEMS;
-        vector_pushback(&clauses, "WHERE s.path = pi.filepath AND pi.playlistid = ?");
-        vector_pushback(&clauses, "ORDER BY pi.id");
-        sql_build_query(&q, &tags, &clauses, &sqlstr);
-        //nitems = count_items(aux->db, T_PLAYLISTITEMS, &clauses, &pl_num);
-        nitems = count_precompiled_items(aux, Q_COUNT_PL_ITEMS, &pl_num);
+        char *sqlstr;
+        vector clauses;
+        keyrange_t range;
+        int total = -1;
+        const listing_keys_t *keys;
+        vector_new(&clauses, 5); // "WHERE", filter, range and "ORDER" 
+        if (filter)
+            aux->filter = filter_compile(aux, filter);
+        char *query_str = (char *)get_smart_playlist_query(aux, pl_num);
+        if (strcmp(query_str, "(NULL)")) {
+            q.type = Q_ITEMLIST;
+            keys   = &item_keys;
+// the playlist's query string, after Q_ITEMLIST's own WHERE
+            vector_pushback(&clauses, "AND");
+            vector_pushback(&clauses, query_str); 
+        } else {
+            q.type = Q_CONTAINERITEMS;
+            keys   = &playlist_item_keys;
+            vector_pushback(&clauses, "WHERE pi.playlistid = ?");
+        }
+// both queries select from songs s, which the filter matches on
+        if (aux->filter)
+            vector_pushback(&clauses, FILTER_CLAUSE);
+        int *bindvar = q.type == Q_ITEMLIST ? NULL : &pl_num;
+// a sorted listing is paged in its sorted order, by put_items()
+        SORTKEYS *order = sortkeys_get(aux, sort);
+        KEYSET *ks = order ? NULL : 
+                     page_listing(aux, q.type, &clauses, keys, index,
+                                  response_key(rows, sizeof(rows), "apso", 
+                                               pl_num, NULL, filter, NULL,
+                                               S_NONE),
+                                  bindvar, &range, &total);
+        if (!ks && !order && q.type == Q_CONTAINERITEMS)
+            vector_pushback(&clauses, playlist_item_keys.order);
+        build_listing(&q, plan, order, &clauses, &sqlstr);
+        vector_free(&clauses);
+        streamed = put_items(req, aux, "apso", plan, sqlstr, bindvar,
+                             total, NULL, 0, order, index, k, rev, &gzip);
+        page_done(aux, ks);
+        sortkeys_release(order);
+        filter_release(aux->filter);
+        aux->filter = NULL;
+        free(sqlstr);
+        free(query_str);
     }
-    struct evbuffer *payload;
-    payload = evbuffer_new();
-    evbuffer_expand(payload, 100000);
-    vector_free(&clauses);
-    // all evbuffers must be created in scope of the evhtp_send_reply()
-    struct evbuffer **items = malloc (nitems * sizeof(struct evbuffer *));
-    int ritems;
-    if (q.type == Q_ITEMLIST)
-        ritems = sql_put_results(&payload, items, aux, &tags, 0, 
-                                 sqlstr, NULL, NULL);
-    else
-        ritems = sql_put_results(&payload, items, aux, &tags, 0, 
-                                 sqlstr, &pl_num, NULL);
-    add_list(req->buffer_out, payload, "apso", ritems, ritems);
-    LOGGER(LOG_INFO, "found %d items", ritems);
-    LOGGER(LOG_INFO, "sending %lu bytes...", 
-                     evbuffer_get_length(req->buffer_out));
-    evhtp_send_reply(req, EVHTP_RES_OK);
-    // cleanup
-    evbuffer_free(payload);
-    if (meta && meta != (char **)default_meta_items)
-        free(meta);
-    for (int i = 0; i < nitems; i++) evbuffer_free(items[i]);
-    free(items);
-    vector_free(&tags);
-    free(sqlstr);
-    free(query_str);
-    if (raw_meta) free(raw_meta);
+    if (!streamed) {
+        LOGGER(LOG_INFO, "sending %lu bytes...", 
+                         evbuffer_get_length(req->buffer_out));
+        add_listing_headers(req, k, rev, gzip);
+        evhtp_send_reply(req, EVHTP_RES_OK);
+    }
+    plan_release(plan);
 }
 
 void res_item_list(evhtp_request_t *req, void *a) {
@@ -404,51 +693,85 @@ void res_item_list(evhtp_request_t *req, void *a) {
     evhtp_query_t *query = req->uri->query;
     evthr_t *thread = get_request_thr(req);
     app *aux = (app *)evthr_get_aux(thread);
-    query_t q;
-    int len;
     const char *param = evhtp_kv_find(query, "meta");
-    char *raw_meta;
-    char **meta;
-    int nmeta;
-    if (param && strcmp(param, "all")) {
-        raw_meta = strdup(param);
-        meta_parse(raw_meta, &meta, &nmeta); 
+    if (param && !strcmp(param, "all")) 
+        param = NULL;
+    const char *filter = evhtp_kv_find(query, "query");
+    const char *delta  = evhtp_kv_find(query, "delta");
+    const char *rev_no = evhtp_kv_find(query, "revision-number");
+    const char *index  = evhtp_kv_find(query, "index");
+    q_sort sort = sortkeys_parse(evhtp_kv_find(query, "sort"));
+    plan_t *plan = plan_get(aux, PLAN_ITEMS, param);
+    char key[RESPONSE_KEY_SIZE], rows[RESPONSE_KEY_SIZE];
+    char endpoint[32];
+    int streamed = 0;
+    uint64_t rev = db_current_revision();
+// delta=d lists only the songs written in revisions d + 1 to 
+// revision-number, and the ids of those deleted in mudl
+    int since = delta ? atoi(delta) : 0;
+    int until = rev_no ? atoi(rev_no) : 0;
+    if (until <= 0 || until > rev) 
+        until = rev;
+    if (since > 0)
+        snprintf(endpoint, sizeof(endpoint), "adbs+%d-%d", since, until);
+    else
+        strcpy(endpoint, "adbs");
+    const char *k = response_key(key, sizeof(key), endpoint, 0, &plan->tags,
+                                 filter, index, sort);
+    if (not_modified(req, k, rev)) {
+        plan_release(plan);
+        return;
+    }
+    int gzip = accepts_gzip(req);
+    if (respcache_send(req->buffer_out, k, rev, &gzip)) {
+        LOGGER(LOG_INFO, "sent cached %s.", k);
     } else {
-        raw_meta = NULL;
-        meta = (char **)default_meta_items;
+        const char *sqlstr = plan->select;
+        char *built = NULL;
+        int *deleted = NULL, ndeleted = 0;
+        keyrange_t range;
+        int total = -1;
+        vector clauses;
+        vector_new(&clauses, 4); // filter, delta, range and order clauses
+        if (filter && (aux->filter = filter_compile(aux, filter)))
+            vector_pushback(&clauses, FILTER_CLAUSE);
+        if (since > 0) {
+            aux->since = since;
+            aux->until = until;
+            vector_pushback(&clauses, DELTA_CLAUSE);
+            deleted = sql_deleted_since(aux, since, until, &ndeleted);
+        }
+// a sorted listing is paged in its sorted order, by put_items()
+        SORTKEYS *order = sortkeys_get(aux, sort);
+        KEYSET *ks = order ? NULL : 
+                     page_listing(aux, Q_ITEMLIST, &clauses, &item_keys, 
+                                  index, response_key(rows, sizeof(rows), 
+                                  endpoint, 0, NULL, filter, NULL, S_NONE),
+                                  NULL, &range, &total);
+        if (clauses.used || order) {
+            query_t q;
+            q.type = Q_ITEMLIST;
+            build_listing(&q, plan, order, &clauses, &built);
+            sqlstr = built;
+        }
+        vector_free(&clauses);
+        streamed = put_items(req, aux, "adbs", plan, sqlstr, NULL, total,
+                             deleted, ndeleted, order, index, k, rev, &gzip);
+        page_done(aux, ks);
+        sortkeys_release(order);
+        filter_release(aux->filter);
+        aux->filter = NULL;
+        aux->since  = 0;
+        free(deleted);
+        free(built);
     }
-    vector tags;
-    vector_new(&tags, 20);
-    for (int i = -1; meta[++i]; ) {
-        int index = meta_find_item_tag(meta[i]);
-        if (index >= 0)
-            vector_pushback(&tags, item_meta_tags + index);
-        else LOGGER(LOG_NOTICE, "unrecognized metatag: %s", meta[i]);
+    if (!streamed) {
+        LOGGER(LOG_INFO, "sending %lu bytes...", 
+                         evbuffer_get_length(req->buffer_out));
+        add_listing_headers(req, k, rev, gzip);
+        evhtp_send_reply(req, EVHTP_RES_OK);
     }
-    char *sqlstr;
-    q.type = Q_ITEMLIST;
-    struct evbuffer *payload;
-    payload = evbuffer_new();
-    sql_build_query(&q, &tags, NULL, &sqlstr); // no clauses
-    size_t nitems = count_all_files(aux);
-    struct evbuffer **items = malloc(nitems * sizeof(struct evbuffer *));
-    int ritems = sql_put_results(&payload, items, aux, &tags, 0, 
-                                 sqlstr, NULL, NULL);
-    add_list(req->buffer_out, payload, "adbs", ritems, ritems);
-    LOGGER(LOG_INFO, "found %lu items.", nitems);
-    LOGGER(LOG_INFO, "sending %lu bytes...", 
-                     evbuffer_get_length(req->buffer_out));
-    evhtp_send_reply(req, EVHTP_RES_OK);
-    // cleanup
-    if (meta && meta != (char **)default_meta_items)
-        free(meta);
-    evbuffer_free(payload);
-    for (int i = 0; i < nitems; i++) 
-        evbuffer_free(items[i]);
-    free(items);
-    vector_free(&tags);
-    free(sqlstr);
-    if (raw_meta) free(raw_meta);
+    plan_release(plan);
 }
 
 void res_content_codes(evhtp_request_t *req, void *a) {
@@ -551,22 +874,14 @@ void res_server_info(evhtp_request_t *req, void *a) {
     evbuffer_free(payload);
 }
 
-int grouplist_itemcb(app *aux, struct evbuffer *item, meta_info_t *info) {
-    int qty;
-    if (info->kind == G_ALBUM) 
-        qty = count_precompiled_items(aux, 
-                Q_COUNT_ALL_ALBUMS, &info->id);
-    else
-        qty = count_precompiled_items(aux, 
-                Q_COUNT_ALL_ARTISTS, &info->id);
-    dmap_add_int(item, "mimc", qty);
+int grouplist_itemcb(app *aux, DMAPBUF *item, meta_info_t *info) {
+// the count and album artist are maintained in the groups table, and 
+// Q_GROUPLIST already leaves out singleton and empty groups
+    dmap_buf_int(item, "mimc", info->item_count);
 // add albumartist if the group is an album
-    if (info->kind == G_ALBUM && qty > 0) {
-        char *asaa = (char *)get_albumgroup_artist(aux, info->id);
-        dmap_add_string(item, "asaa", asaa);
-        free(asaa);
-    }
-    return qty > 1;  // don't add singleton or empty groups
+    if (info->kind == G_ALBUM)
+        dmap_buf_string(item, "asaa", info->album_artist);
+    return 1;
 }
 
 void res_group_list(evhtp_request_t *req, void *a) {
@@ -591,50 +906,71 @@ void res_group_list(evhtp_request_t *req, void *a) {
         tag = "agar";
     }
     const char *param = evhtp_kv_find(req->uri->query, "meta");
-    char *raw_meta;
-    char **meta;
-    int nmeta;
-    vector tags;
-    vector_new(&tags, 4);
-    if (param && strcmp(param, "all")) {
-        raw_meta = strdup(param);
-        meta_parse(raw_meta, &meta, &nmeta); 
-    } else {
-        raw_meta = NULL;
-        meta = (char **)default_meta_group;
+    if (param && !strcmp(param, "all")) 
+        param = NULL;
+    plan_t *plan = plan_get(aux, PLAN_GROUPS, param);
+    const char *index = evhtp_kv_find(req->uri->query, "index");
+    char key[RESPONSE_KEY_SIZE], rows[RESPONSE_KEY_SIZE];
+    uint64_t rev = db_current_revision();
+    const char *k = response_key(key, sizeof(key), tag, type, &plan->tags,
+                                 NULL, index, S_NONE);
+    if (not_modified(req, k, rev)) {
+        plan_release(plan);
+        return;
     }
-    for (int i = -1; meta[++i]; ) {
-        int index = meta_find_group_tag(meta[i]);
-        if (index >= 0)
-            vector_pushback(&tags, group_meta_tags + index);
-        else LOGGER(LOG_NOTICE, "unrecognized metatag: %s", meta[i]);
+    const char *sqlstr = plan->select;
+    char *built = NULL;
+    keyrange_t range;
+    int total = -1;
+    vector clauses;
+    vector_new(&clauses, 2);
+    KEYSET *ks = page_listing(aux, Q_GROUPLIST, &clauses, &group_keys, 
+                              index, response_key(rows, sizeof(rows), tag, 
+                              type, NULL, NULL, NULL, S_NONE), 
+                              &type, &range, &total);
+    if (ks) {
+        query_t q;
+        q.type = Q_GROUPLIST;
+        sql_build_query_columns(&q, plan->columns, &clauses, &built);
+        sqlstr = built;
     }
-    struct evbuffer *payload;
-    payload = evbuffer_new();
-    char *sqlstr = NULL;
-    query_t q = { Q_GROUPLIST, S_NONE, L_NONE };
-    sql_build_query(&q, &tags, NULL, &sqlstr); // no clauses
-    size_t nitems;
-    if (type == G_ALBUM) 
-        nitems = count_precompiled_items(aux, Q_COUNT_ALL_ALBUMS, NULL);
-    else
-        nitems = count_precompiled_items(aux, Q_COUNT_ALL_ARTISTS, NULL);
-    struct evbuffer **items = malloc(nitems * sizeof(struct evbuffer *));
-    int ritems = sql_put_results(&payload, items, aux, &tags, 1, 
-                                 sqlstr, &type, grouplist_itemcb);
-    add_list(req->buffer_out, payload, tag, ritems, ritems);
+    vector_free(&clauses);
+    DMAPBUF *body = dmap_buf_new(4096);
+    listing_t list;
+    list_open(body, tag, &list);
+    int ritems = sql_put_results(body, aux, plan, sqlstr, 
+                                 &type, grouplist_itemcb);
+    page_done(aux, ks);
+    free(built);
+    if (ritems < 0) {
+        LOGGER(LOG_ERR, "failed to list %s", type_str);
+        dmap_buf_free(body);
+        evhtp_send_reply(req, EVHTP_RES_ERROR);
+        plan_release(plan);
+        return;
+    }
+    list_close(body, &list, total < 0 ? ritems : total, ritems);
+    int gzip = accepts_gzip(req);
+    respcache_store(req->buffer_out, NULL, 0, body, &gzip);
     LOGGER(LOG_INFO, "found %i items.", ritems);
     LOGGER(LOG_INFO, "sending %lu bytes...", 
                      evbuffer_get_length(req->buffer_out));
+    add_listing_headers(req, k, rev, gzip);
     evhtp_send_reply(req, EVHTP_RES_OK);
 // cleanup
-    if (meta && meta != (char **)default_meta_group)
-        free(meta);
-    evbuffer_free(payload);
-    free(items);
-    vector_free(&tags);
-    if (sqlstr) free(sqlstr);
-    if (raw_meta) free(raw_meta);
+    dmap_buf_free(body);
+    plan_release(plan);
+}
+
+/**
+ * @brief the stream listener serves song streams and nothing else
+ */
+void register_stream_callbacks(evhtp_t *evhtp) {
+    LOGGER(LOG_INFO, "registering stream callbacks...");
+evhtp_set_regex_cb(evhtp, 
+                   DB_STR REG_NUM "/items/", 
+                   res_stream_item, 
+                   "item stream");
 }
 
 void register_callbacks(evhtp_t *evhtp) {
@@ -643,15 +979,15 @@ void register_callbacks(evhtp_t *evhtp) {
 // regex callbacks must be registered in correct order: most specific first
 evhtp_set_regex_cb(evhtp, 
                    DB_STR REG_NUM "/browse/", 
-                   server_xmlrpc, 
+                   res_browse, 
                    "database browse");
 evhtp_set_regex_cb(evhtp, 
                    DB_STR REG_NUM "/items/" REG_NUM "/extra_data/artwork", 
-                   server_xmlrpc, 
+                   res_item_artwork, 
                    "item artwork");
 evhtp_set_regex_cb(evhtp, 
                    DB_STR REG_NUM "/items/", 
-                   res_stream_item, 
+                   conf.streamport > 0 ? res_stream_redirect : res_stream_item, 
                    "item stream");
 evhtp_set_regex_cb(evhtp, 
                    DB_STR REG_NUM "/items", 
@@ -667,7 +1003,7 @@ evhtp_set_regex_cb(evhtp,
                    "containers list");
 evhtp_set_regex_cb(evhtp, 
                    DB_STR REG_NUM "/groups/" REG_NUM "/extra_data/artwork", 
-                   server_xmlrpc, 
+                   res_group_artwork, 
                    "group artwork");
 evhtp_set_regex_cb(evhtp, 
                    DB_STR REG_NUM "/groups", 
@@ -10,6 +10,7 @@ void app_init_thread(evhtp_t *htp, evthr_t *thread, void *arg);
 void precompile_statements(void *arg);
 void app_term_thread(evhtp_t *htp, evthr_t *thread, void *arg);
 void add_headers_out(evhtp_request_t *req);
+void register_stream_callbacks(evhtp_t *evhtp);
 void register_callbacks(evhtp_t *evhtp);
 void *create_segment(int id, void *a);
 #endif
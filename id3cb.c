@@ -195,6 +195,10 @@ id3_frame *id3_current_frame (ID3CB *id3) {
     if (!id3) return NULL;
     return &id3->frame;
 }
+// the offset in the file of the current frame's data
+size_t id3_frame_offset (ID3CB *id3) {
+    return id3->position + 10;
+}
 void id3_set_header_handler(ID3CB *id3, id3_header_handler handler) {
     if (!id3) return;
     if (handler)
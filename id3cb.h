@@ -14,6 +14,7 @@
                ((*(buf + 3) & 0xff));               \
        } while (0)
 
+#define ID3_UNSYNCHRONISED (1 << 7)
 #define ID3_HAS_EXTENDED (1 << 6)
 #define ID3_AUTOCONVERT_TO_UTF8 1
 
@@ -21,6 +22,7 @@ ID3CB *id3_new_parser(int flags);
 char *id3_get_scratch(ID3CB *id3, size_t size);
 void id3_dispose_parser(ID3CB *id3);
 id3_frame *id3_current_frame (ID3CB *id3);
+size_t id3_frame_offset (ID3CB *id3);
 const char *id3_get_frame_description(const id3_frame_t ftype);
 const char *id3_get_text_description(const id3_text_t ttype);
 const char *id3_get_url_description(const id3_url_t utype);
@@ -0,0 +1,180 @@
+// Positional index= ranges without OFFSET.
+// A keyset holds the ordering keys of every row of a listing, in listing
+// order.  It is read once per revision by a key-only version of the
+// listing query and shared by every request for the same rows, whatever
+// their meta=.  The range a-b is then the rows from the key of row a to
+// the key of row b, which SQLite finds by seeking an index, so a page deep
+// into the listing costs no more than the first.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "util.h"
+#include "sql.h"
+#include "writer.h"
+#include "keyset.h"
+
+#define KEYSETS 16
+
+struct _keyset {
+    volatile int    refs;
+    char           *key;
+    uint64_t        revision;
+    long            n;
+    sqlite3_int64  *ids;
+    size_t         *names;    // offsets into pool, if the rows are named
+    char           *pool;
+};
+
+static KEYSET          *keysets[KEYSETS];
+static int              next_slot = 0;
+static pthread_mutex_t  keyset_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static KEYSET *_build(app *aux, const char *sqlstr, int *bindvar, 
+                      int named) {
+    KEYSET *ks = calloc(1, sizeof(KEYSET));
+    long cap = 1024;
+    size_t used = 0, size = named ? 16384 : 0;
+    ks->refs = 1;
+    ks->ids  = malloc(cap * sizeof(sqlite3_int64));
+    if (named) {
+        ks->names = malloc(cap * sizeof(size_t));
+        ks->pool  = malloc(size);
+    }
+    sqlite3_stmt *stmt = sql_open_results(aux, sqlstr, bindvar);
+    if (!stmt) return ks;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (ks->n == cap) {
+            cap *= 2;
+            ks->ids = realloc(ks->ids, cap * sizeof(sqlite3_int64));
+            if (named)
+                ks->names = realloc(ks->names, cap * sizeof(size_t));
+        }
+        ks->ids[ks->n] = sqlite3_column_int64(stmt, 0);
+        if (named) {
+            const char *name = (const char *)sqlite3_column_text(stmt, 1);
+            size_t len = name ? sqlite3_column_bytes(stmt, 1) : 0;
+            while (used + len + 1 > size)
+                ks->pool = realloc(ks->pool, size *= 2);
+            memcpy(ks->pool + used, name ? name : "", len);
+            ks->pool[used + len] = '\0';
+            ks->names[ks->n] = used;
+            used += len + 1;
+        }
+        ks->n++;
+    }
+    sql_close_results(aux, stmt);
+    return ks;
+}
+
+void keyset_release(KEYSET *ks) {
+    if (ks && __sync_sub_and_fetch(&ks->refs, 1) == 0) {
+        free(ks->key);
+        free(ks->ids);
+        free(ks->names);
+        free(ks->pool);
+        free(ks);
+    }
+}
+
+/**
+ * @brief the keyset of the listing that sqlstr selects the keys of: the
+ *        key in the first column, and if named, the name it is ordered 
+ *        by first in the second.  it is shared under key, if that isn't
+ *        NULL, until the next commit.  release it with keyset_release().
+ */
+KEYSET *keyset_get(app *aux, const char *key, const char *sqlstr, 
+                   int *bindvar, int named) {
+    KEYSET *ks = NULL;
+    uint64_t revision = db_current_revision();
+    if (key) {
+        pthread_mutex_lock(&keyset_mutex);
+        for (int i = 0; i < KEYSETS; i++)
+            if (keysets[i] && keysets[i]->revision == revision 
+                && !strcmp(keysets[i]->key, key)) {
+                ks = keysets[i];
+                __sync_add_and_fetch(&ks->refs, 1);
+                break;
+            }
+        pthread_mutex_unlock(&keyset_mutex);
+        if (ks) return ks;
+    }
+    ks = _build(aux, sqlstr, bindvar, named);
+    ks->revision = revision;
+    LOGGER(LOG_INFO, "built keyset of %ld rows for '%s'", ks->n, STR(key));
+// keep it only if no commit could have slipped in while it was read
+    if (!key || db_current_revision() != revision)
+        return ks;
+    ks->key = strdup(key);
+    __sync_add_and_fetch(&ks->refs, 1);  // the reference held by keysets[]
+    pthread_mutex_lock(&keyset_mutex);
+    int slot = -1;
+    for (int i = 0; i < KEYSETS && slot < 0; i++)
+        if (!keysets[i] || keysets[i]->revision != revision)
+            slot = i;
+    if (slot < 0) {
+        slot = next_slot;
+        next_slot = (next_slot + 1) % KEYSETS;
+    }
+    KEYSET *old = keysets[slot];
+    keysets[slot] = ks;
+    pthread_mutex_unlock(&keyset_mutex);
+    keyset_release(old);
+    return ks;
+}
+
+long keyset_count(KEYSET *ks) {
+    return ks->n;
+}
+
+/**
+ * @brief resolve an index= of the form a-b, a- or a to the keys of its
+ *        first and last rows, clamped to the listing.
+ * @return the number of rows in the range, 0 if it is empty, in which
+ *         case r is set to a range no key falls in
+ */
+long keyset_range(KEYSET *ks, const char *index, keyrange_t *r) {
+    long first = 0, last = ks->n - 1;
+    char dash = 0;
+    int n = sscanf(index, "%ld%c%ld", &first, &dash, &last);
+    if (n < 1 || first < 0) first = 0;
+    if (n == 1) last = first;
+    if (n == 2) last = ks->n - 1;
+    if (last > ks->n - 1) last = ks->n - 1;
+    if (first > last) {
+        r->lo = 1;
+        r->hi = 0;
+        r->lo_name = r->hi_name = "";
+        return 0;
+    }
+    r->lo = ks->ids[first];
+    r->hi = ks->ids[last];
+    r->lo_name = ks->names ? ks->pool + ks->names[first] : NULL;
+    r->hi_name = ks->names ? ks->pool + ks->names[last]  : NULL;
+    return last - first + 1;
+}
+
+static void _bind_int(sqlite3_stmt *stmt, const char *param, 
+                      sqlite3_int64 val) {
+    int i = sqlite3_bind_parameter_index(stmt, param);
+    if (i) sqlite3_bind_int64(stmt, i, val);
+}
+
+static void _bind_text(sqlite3_stmt *stmt, const char *param, 
+                       const char *val) {
+    int i = sqlite3_bind_parameter_index(stmt, param);
+    if (i) sqlite3_bind_text(stmt, i, val ? val : "", -1, SQLITE_TRANSIENT);
+}
+
+/**
+ * @brief bind a range to the parameters of stmt that it has
+ */
+void keyset_bind(keyrange_t *r, sqlite3_stmt *stmt) {
+    _bind_int (stmt, ":lo", r->lo);
+    _bind_int (stmt, ":hi", r->hi);
+    _bind_text(stmt, ":lo_name", r->lo_name);
+    _bind_text(stmt, ":hi_name", r->hi_name);
+}
@@ -0,0 +1,24 @@
+#ifndef __KEYSET_H__
+#define __KEYSET_H__
+#include <stdint.h>
+#include <sqlite3.h>
+#include "util.h"
+
+// index= ranges over listings, resolved to a range of the listing's
+// ordering keys rather than an OFFSET.  listing queries take the range as
+// :lo and :hi, and :lo_name and :hi_name where rows are ordered by name.
+
+typedef struct _keyset KEYSET;
+
+typedef struct keyrange_t {
+    sqlite3_int64  lo, hi;
+    const char    *lo_name, *hi_name;
+} keyrange_t;
+
+KEYSET *keyset_get    (app *aux, const char *key, const char *sqlstr, 
+                       int *bindvar, int named);
+void    keyset_release(KEYSET *ks);
+long    keyset_count  (KEYSET *ks);
+long    keyset_range  (KEYSET *ks, const char *index, keyrange_t *r);
+void    keyset_bind   (keyrange_t *r, sqlite3_stmt *stmt);
+#endif
@@ -0,0 +1,254 @@
+// Chunked delivery of large item listings.
+// The outer DMAP lengths are known up front from a sizing pass, so the
+// header goes out first and the items follow as the SQLite cursor advances.
+// At most one window of encoded items is held in memory, and no more is
+// encoded until the connection's output buffer has drained below a window.
+// The read transaction that keeps the listing consistent with its sizing
+// pass is held on a connection of its own for as long as the client takes
+// to read the listing, so the thread's other requests never see its stale
+// snapshot.  Idle listing connections are kept per thread for reuse.
+
+#include <stdlib.h>
+#include <string.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <evhtp/evhtp.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "config.h"
+#include "dmap.h"
+#include "vector.h"
+#include "util.h"
+#include "sql.h"
+#include "plan.h"
+#include "filter.h"
+#include "stmtcache.h"
+#include "listing.h"
+
+#define SPARES 2                // idle listing connections kept per thread
+
+typedef struct listing_stream_t {
+    evhtp_request_t *req;
+    app             *aux;
+    sqlite3_stmt    *stmt;
+    plan_t          *plan;
+    FILTER          *filter;  // bound to stmt
+    int             *deleted; // the mudl list of a delta listing, or NULL
+    int              ndeleted;
+    DMAPBUF         *window;
+    evbuf_t         *chunk;
+    evbuf_t         *out;     // the connection's output buffer
+    struct evbuffer_cb_entry *drain;
+    struct event    *refill;
+    int              row;
+    int              done;
+} listing_stream_t;
+
+static void _close(app *snap) {
+    stmtcache_free(snap->stmtcache);
+    sqlite3_close_v2(snap->db);
+    free(snap);
+}
+
+/**
+ * @brief open a read transaction on a listing connection of this thread,
+ *        so that a sizing pass and the listing that follows it see the
+ *        same rows.  the connection takes the thread's bound filter, key
+ *        range and delta.
+ * @return the connection, to run the listing's queries on
+ */
+app *listing_snapshot_begin(app *aux) {
+    app *snap = aux->spare;
+    if (snap) {
+        aux->spare = snap->spare;
+    } else {
+        snap = calloc(1, sizeof(app));
+        snap->header    = -1;
+        snap->thread_id = aux->thread_id;
+        snap->parent    = aux->parent;
+        snap->base      = aux->base;
+        snap->config    = aux->config;
+        snap->owner     = aux;
+        db_open_database(snap, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX |
+                               SQLITE_OPEN_SHAREDCACHE);
+        filter_register(snap);
+        snap->stmtcache = stmtcache_new(snap->db, conf.stmtcache);
+    }
+    snap->spare  = NULL;
+    snap->filter = aux->filter;
+    snap->range  = aux->range;
+    snap->since  = aux->since;
+    snap->until  = aux->until;
+    if (sqlite3_exec(snap->db, "BEGIN TRANSACTION;", 0, 0, 0) != SQLITE_OK)
+        LOGGER(LOG_ERR, "failed to begin listing snapshot");
+    return snap;
+}
+
+/**
+ * @brief end the read transaction, and give the connection back to its
+ *        thread
+ */
+void listing_snapshot_end(app *snap) {
+    app *aux = snap->owner;
+    sqlite3_exec(snap->db, "COMMIT;", 0, 0, 0);
+    snap->filter = NULL;
+    snap->range  = NULL;
+    snap->since  = 0;
+    int spares = 0;
+    for (app *s = aux->spare; s; s = s->spare)
+        spares++;
+    if (spares >= SPARES) {
+        _close(snap);
+        return;
+    }
+    snap->spare = aux->spare;
+    aux->spare  = snap;
+}
+
+void listing_term_thread(app *aux) {
+    while (aux->spare) {
+        app *snap = aux->spare;
+        aux->spare = snap->spare;
+        _close(snap);
+    }
+}
+
+// release the cursor and the snapshot; the request may still be live
+static void _finish(listing_stream_t *ls) {
+    if (ls->done) return;
+    ls->done = 1;
+    sql_close_results(ls->aux, ls->stmt);
+    listing_snapshot_end(ls->aux);
+    evbuffer_remove_cb_entry(ls->out, ls->drain);
+}
+
+// encode up to a window of items at a time until the output is full
+static void _fill(listing_stream_t *ls) {
+    size_t window = conf.listwindow;
+    int ret = SQLITE_ROW;
+    while (evbuffer_get_length(ls->out) < window) {
+        while (dmap_buf_length(ls->window) < window 
+               && (ret = sqlite3_step(ls->stmt)) == SQLITE_ROW) {
+            size_t item = dmap_buf_open_list(ls->window, "mlit");
+            plan_put_row(ls->plan, ls->window, ls->stmt, ls->row++, NULL);
+            dmap_buf_close_list(ls->window, item);
+        }
+// the deleted ids of a delta listing follow the items
+        if (ret != SQLITE_ROW)
+            listing_put_deleted(ls->window, ls->deleted, ls->ndeleted);
+        if (dmap_buf_length(ls->window)) {
+            dmap_buf_send(ls->window, ls->chunk);
+            evhtp_send_reply_chunk(ls->req, ls->chunk);
+        }
+        if (ret != SQLITE_ROW) {
+            LOGGER(LOG_INFO, "streamed %d items.", ls->row);
+            _finish(ls);
+// request_fini frees ls, possibly from inside this call
+            evhtp_send_reply_chunk_end(ls->req);
+            return;
+        }
+    }
+}
+
+static void _refill_cb(evutil_socket_t fd, short events, void *arg) {
+    listing_stream_t *ls = (listing_stream_t *)arg;
+    if (!ls->done) _fill(ls);
+}
+
+// defer the refill to the event loop rather than encoding from inside
+// the output buffer's own callback
+static void _drain_cb(struct evbuffer *buf, 
+                      const struct evbuffer_cb_info *info, void *arg) {
+    listing_stream_t *ls = (listing_stream_t *)arg;
+    if (info->n_deleted && evbuffer_get_length(buf) < conf.listwindow)
+        event_active(ls->refill, EV_TIMEOUT, 0);
+}
+
+static evhtp_res _fini_cb(evhtp_request_t *req, void *arg) {
+    listing_stream_t *ls = (listing_stream_t *)arg;
+    if (!ls->done)
+        LOGGER(LOG_INFO, "listing interrupted after %d items.", ls->row);
+    _finish(ls);
+    event_free(ls->refill);
+    evbuffer_free(ls->chunk);
+    dmap_buf_free(ls->window);
+    plan_release(ls->plan);
+    filter_release(ls->filter);
+    free(ls->deleted);
+    free(ls);
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief the bytes listing_put_deleted() adds for the same ids
+ */
+size_t listing_deleted_size(const int *deleted, int ndeleted) {
+    return deleted ? 8 + 12 * (size_t)ndeleted : 0;
+}
+
+/**
+ * @brief add the mudl list of a delta listing: the ids of the items
+ *        deleted since the client's revision.  nothing if deleted is NULL.
+ */
+void listing_put_deleted(DMAPBUF *out, const int *deleted, int ndeleted) {
+    if (!deleted) return;
+    size_t mudl = dmap_buf_open_list(out, "mudl");
+    for (int i = 0; i < ndeleted; i++)
+        dmap_buf_int(out, "miid", deleted[i]);
+    dmap_buf_close_list(out, mudl);
+}
+
+/**
+ * @brief send a listing of nitems items, of total in the whole listing,
+ *        encoding to size bytes as a chunked reply, followed by the 
+ *        deleted ids of a delta listing if deleted isn't NULL.  aux is
+ *        the connection listing_snapshot_begin() returned, which the 
+ *        stream ends once the last item has been encoded.
+ */
+void listing_stream(evhtp_request_t *req, app *aux, const char *code,
+                    plan_t *plan, const char *sqlstr, int *bindvar,
+                    size_t size, int nitems, int total,
+                    const int *deleted, int ndeleted) {
+    listing_stream_t *ls = calloc(1, sizeof(listing_stream_t));
+    ls->req    = req;
+    ls->aux    = aux;
+    ls->stmt   = sql_open_results(aux, sqlstr, bindvar);
+    if (!ls->stmt) {
+        listing_snapshot_end(aux);
+        free(ls);
+        evhtp_send_reply(req, EVHTP_RES_SERVERR);
+        return;
+    }
+    ls->plan   = plan;
+    plan->refs++;
+    if (aux->filter)
+        ls->filter = filter_ref(aux->filter);
+    if (deleted) {
+        ls->deleted  = malloc((ndeleted ? ndeleted : 1) * sizeof(int));
+        ls->ndeleted = ndeleted;
+        memcpy(ls->deleted, deleted, ndeleted * sizeof(int));
+    }
+    ls->window = dmap_buf_new(conf.listwindow);
+    ls->chunk  = evbuffer_new();
+    ls->out    = bufferevent_get_output(req->conn->bev);
+    ls->refill = event_new(aux->base, -1, 0, _refill_cb, ls);
+    ls->drain  = evbuffer_add_cb(ls->out, _drain_cb, ls);
+// the list header, with lengths from the sizing pass
+    size_t list = dmap_buf_open_list(ls->window, code);
+    dmap_buf_int (ls->window, "mstt", 200);
+    dmap_buf_char(ls->window, "muty", 0);
+    dmap_buf_int (ls->window, "mtco", total);
+    dmap_buf_int (ls->window, "mrco", nitems);
+    size_t mlcl = dmap_buf_open_list(ls->window, "mlcl");
+    dmap_buf_set_int(ls->window, mlcl + 4, size);
+    dmap_buf_set_int(ls->window, list + 4, 
+                     dmap_buf_length(ls->window) - list - 8 + size
+                     + listing_deleted_size(deleted, ndeleted));
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, 
+                   evhtp_hook_cast(_fini_cb), ls);
+    LOGGER(LOG_INFO, "streaming %d items, %lu bytes...", nitems, size);
+    req->flags |= EVHTP_REQ_FLAG_CHUNKED;
+    evhtp_send_reply_chunk_start(req, EVHTP_RES_OK);
+    _fill(ls);
+}
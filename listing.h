@@ -0,0 +1,23 @@
+#ifndef __LISTING_H__
+#define __LISTING_H__
+
+#include <evhtp/evhtp.h>
+#include "vector.h"
+#include "util.h"
+#include "plan.h"
+
+// listings too large to be encoded in one buffer are sent as a chunked
+// reply, encoded a window at a time as the output drains.  the sizing pass
+// and the stream read the same snapshot of the library, on a connection of
+// their own.
+
+app *listing_snapshot_begin(app *aux);
+void listing_snapshot_end  (app *snap);
+void listing_term_thread   (app *aux);
+void listing_stream        (evhtp_request_t *req, app *aux, const char *code,
+                            plan_t *plan, const char *sqlstr, int *bindvar,
+                            size_t size, int nitems, int total,
+                            const int *deleted, int ndeleted);
+size_t listing_deleted_size(const int *deleted, int ndeleted);
+void   listing_put_deleted (DMAPBUF *out, const int *deleted, int ndeleted);
+#endif
@@ -0,0 +1,174 @@
+// Long-polled /update requests.
+// A client that has seen revision r asks for /update?revision-number=r and
+// expects no answer until the library has moved past r.  Such requests are
+// paused and parked, at most one per session, on the evhtp thread that
+// received them, so they cost nothing while idle.  The writer wakes every
+// thread through a pipe each time it commits, and each thread answers its
+// own parked requests with the new revision.  A request parked after a 
+// commit finds the wake still pending behind it, so none is missed.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include <evhtp/evhtp.h>
+#include "system.h"
+#include "dmap.h"
+#include "util.h"
+#include "writer.h"
+#include "longpoll.h"
+
+typedef struct parked_t {
+    evhtp_request_t    *req;
+    int                 session;
+    int                 revision;   // the client's
+    struct longpoll_t  *lp;         // NULL once answered
+    struct parked_t    *next;
+} parked_t;
+
+typedef struct longpoll_t {
+    int                 fds[2];     // the wake pipe
+    struct event       *wake;
+    parked_t           *parked;
+    int                 nparked;
+} longpoll_t;
+
+static longpoll_t     **threads  = NULL;
+static int              nthreads = 0;
+static pthread_mutex_t  longpoll_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void _unlink(parked_t *p) {
+    longpoll_t *lp = p->lp;
+    if (!lp) return;
+    for (parked_t **pp = &lp->parked; *pp; pp = &(*pp)->next)
+        if (*pp == p) {
+            *pp = p->next;
+            lp->nparked--;
+            break;
+        }
+    p->lp = NULL;
+}
+
+/**
+ * @brief answer an /update request with the given revision
+ */
+void longpoll_reply(evhtp_request_t *req, uint64_t revision) {
+    dmap_add_list(req->buffer_out, "mupd", 24);
+    dmap_add_int (req->buffer_out, "mstt", 200);
+    dmap_add_int (req->buffer_out, "musr", (int)revision);
+    evhtp_send_reply(req, EVHTP_RES_OK);
+}
+
+// answer and resume a parked request; request_fini frees it later
+static void _answer(parked_t *p, uint64_t revision) {
+    _unlink(p);
+    longpoll_reply(p->req, revision);
+    evhtp_request_resume(p->req);
+}
+
+static void _wake_cb(evutil_socket_t fd, short events, void *arg) {
+    longpoll_t *lp = (longpoll_t *)arg;
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    uint64_t revision = db_current_revision();
+    int n = 0;
+    parked_t *p = lp->parked, *next;
+    for (; p; p = next) {
+        next = p->next;
+        if (p->revision < revision) {
+            _answer(p, revision);
+            n++;
+        }
+    }
+    if (n) LOGGER(LOG_INFO, "answered %d parked updates at revision %lu.", 
+                            n, (unsigned long)revision);
+}
+
+// the client went away, or the answer has been sent
+static evhtp_res _fini_cb(evhtp_request_t *req, void *arg) {
+    parked_t *p = (parked_t *)arg;
+    _unlink(p);
+    free(p);
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief pause req until the library moves past revision.  an earlier
+ *        request from the same session is answered now.
+ */
+void longpoll_park(evhtp_request_t *req, app *aux, int session, 
+                   int revision) {
+    longpoll_t *lp = aux->longpoll;
+    for (parked_t *p = lp->parked; p; p = p->next)
+        if (p->session == session) {
+            _answer(p, db_current_revision());
+            break;
+        }
+    parked_t *p = malloc(sizeof(parked_t));
+    p->req      = req;
+    p->session  = session;
+    p->revision = revision;
+    p->lp       = lp;
+    p->next     = lp->parked;
+    lp->parked  = p;
+    lp->nparked++;
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, 
+                   evhtp_hook_cast(_fini_cb), p);
+    evhtp_request_pause(req);
+    LOGGER(LOG_DEBUG, "parked update for session %d at revision %d, "
+                      "%d parked.", session, revision, lp->nparked);
+}
+
+/**
+ * @brief called by the writer after each commit
+ */
+void longpoll_wake() {
+    pthread_mutex_lock(&longpoll_mutex);
+    for (int i = 0; i < nthreads; i++)
+// a full pipe already has a wake pending
+        if (write(threads[i]->fds[1], "", 1) < 0 && errno != EAGAIN)
+            LOGGER(LOG_ERR, "failed to wake thread: %s", strerror(errno));
+    pthread_mutex_unlock(&longpoll_mutex);
+}
+
+void longpoll_init_thread(app *aux) {
+    longpoll_t *lp = calloc(1, sizeof(longpoll_t));
+    if (pipe(lp->fds) < 0) {
+        LOGGER(LOG_ERR, "can't create wake pipe, updates won't be parked");
+        free(lp);
+        aux->longpoll = NULL;
+        return;
+    }
+    fcntl(lp->fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(lp->fds[1], F_SETFL, O_NONBLOCK);
+    lp->wake = event_new(aux->base, lp->fds[0], EV_READ | EV_PERSIST, 
+                         _wake_cb, lp);
+    event_add(lp->wake, NULL);
+    aux->longpoll = lp;
+    pthread_mutex_lock(&longpoll_mutex);
+    threads = realloc(threads, (nthreads + 1) * sizeof(longpoll_t *));
+    threads[nthreads++] = lp;
+    pthread_mutex_unlock(&longpoll_mutex);
+}
+
+void longpoll_term_thread(app *aux) {
+    longpoll_t *lp = aux->longpoll;
+    if (!lp) return;
+    pthread_mutex_lock(&longpoll_mutex);
+    for (int i = 0; i < nthreads; i++)
+        if (threads[i] == lp) {
+            threads[i] = threads[--nthreads];
+            break;
+        }
+    pthread_mutex_unlock(&longpoll_mutex);
+    while (lp->parked)
+        _unlink(lp->parked);
+    event_free(lp->wake);
+    close(lp->fds[0]);
+    close(lp->fds[1]);
+    free(lp);
+    aux->longpoll = NULL;
+}
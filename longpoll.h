@@ -0,0 +1,16 @@
+#ifndef __LONGPOLL_H__
+#define __LONGPOLL_H__
+#include <stdint.h>
+#include <evhtp/evhtp.h>
+#include "util.h"
+
+// /update requests from clients that are already up to date are parked on
+// the evhtp thread that received them until the writer next commits.
+
+void longpoll_init_thread(app *aux);
+void longpoll_term_thread(app *aux);
+void longpoll_reply      (evhtp_request_t *req, uint64_t revision);
+void longpoll_park       (evhtp_request_t *req, app *aux, int session, 
+                          int revision);
+void longpoll_wake       ();
+#endif
@@ -23,6 +23,9 @@
 #include "scanner.h"
 #include "system.h"
 #include "stream.h"
+#include "respcache.h"
+#include "reader.h"
+#include "prefetch.h"
 /**
  * @brief this is called automatically when the main thread is cancelled
  */
@@ -31,13 +34,17 @@ static void main_cleanup(void *arg) {
     event_base_loopbreak(parent->base);
     evhtp_unbind_socket(parent->htp);
     evhtp_free(parent->htp);
+    if (parent->streamhtp) {
+        evhtp_unbind_socket(parent->streamhtp);
+        evhtp_free(parent->streamhtp);
+    }
     event_base_free(parent->base);
     watcher_active = 0;
     writer_active = 0;
     LOGGER(LOG_INFO, "main thread terminated.");
 }
 
-static const char option_string[]  = "DVc:d:s:p:t:T:B:SC:Xy:k:K:L:";
+static const char option_string[]  = "DVc:d:s:p:t:T:B:SC:Xy:k:K:L:R:m:w:Q:z:Z:F:a:b:P:N:r:n:M:U:u:E:";
 static struct option long_options[] = {
     { "daemonize",          no_argument,       0,       'D' },
     { "verbose",            no_argument,       0,       'V' },
@@ -55,6 +62,23 @@ static struct option long_options[] = {
     { "chunk-size",         required_argument, 0,       'k' },
     { "chunk-preload",      required_argument, 0,       'K' },
     { "chunk-delay",        required_argument, 0,       'L' },
+    { "response-cache",     required_argument, 0,       'R' },
+    { "listing-stream",     required_argument, 0,       'm' },
+    { "listing-window",     required_argument, 0,       'w' },
+    { "statement-cache",    required_argument, 0,       'Q' },
+    { "gzip-level",         required_argument, 0,       'z' },
+    { "gzip-threshold",     required_argument, 0,       'Z' },
+    { "sendfile-networks",  required_argument, 0,       'F' },
+    { "stream-lead",        required_argument, 0,       'a' },
+    { "stream-burst",       required_argument, 0,       'b' },
+    { "stream-port",        required_argument, 0,       'P' },
+    { "stream-threads",     required_argument, 0,       'N' },
+    { "stream-readers",     required_argument, 0,       'r' },
+    { "prefetch-tracks",    required_argument, 0,       'n' },
+    { "prefetch-size",      required_argument, 0,       'M' },
+    { "stream-cap",         required_argument, 0,       'U' },
+    { "client-cap",         required_argument, 0,       'u' },
+    { "egress-cap",         required_argument, 0,       'E' },
     { 0, 0, 0, 0 }
 };
 
@@ -88,9 +112,26 @@ int main (int argc, char *argv[]) {
     conf.chunksize    = -1;
     conf.chunkpreload = -1;
     conf.chunkdelay   = -1;
+    conf.respcache    = -1;
+    conf.liststream   = -1;
+    conf.listwindow   = -1;
+    conf.stmtcache    = -1;
+    conf.gziplevel    = -1;
+    conf.gzipmin      = -1;
+    conf.streamlead   = -1;
+    conf.streamburst  = -1;
+    conf.streamport   = -1;
+    conf.streamthreads = -1;
+    conf.streamreaders = -1;
+    conf.prefetchtracks = -1;
+    conf.prefetchsize  = -1;
+    conf.streamcap     = -1;
+    conf.clientcap     = -1;
+    conf.egresscap     = -1;
     conf.server_name  = hostname;
     conf.library_name = NULL;
     conf.lock_style   = NULL;
+    conf.sendfile_nets = NULL;
 
 // process cmdline args
     while(1) {
@@ -138,6 +179,40 @@ int main (int argc, char *argv[]) {
                       break;
             case 'L': INTARG(conf.chunkdelay, "chunk-delay");
                       break;
+            case 'R': INTARG(conf.respcache, "response-cache");
+                      break;
+            case 'm': INTARG(conf.liststream, "listing-stream");
+                      break;
+            case 'w': INTARG(conf.listwindow, "listing-window");
+                      break;
+            case 'Q': INTARG(conf.stmtcache, "statement-cache");
+                      break;
+            case 'z': INTARG(conf.gziplevel, "gzip-level");
+                      break;
+            case 'Z': INTARG(conf.gzipmin, "gzip-threshold");
+                      break;
+            case 'F': conf.sendfile_nets = strdup(optarg);
+                      break;
+            case 'a': INTARG(conf.streamlead, "stream-lead");
+                      break;
+            case 'b': INTARG(conf.streamburst, "stream-burst");
+                      break;
+            case 'P': INTARG(conf.streamport, "stream-port");
+                      break;
+            case 'N': INTARG(conf.streamthreads, "stream-threads");
+                      break;
+            case 'r': INTARG(conf.streamreaders, "stream-readers");
+                      break;
+            case 'n': INTARG(conf.prefetchtracks, "prefetch-tracks");
+                      break;
+            case 'M': INTARG(conf.prefetchsize, "prefetch-size");
+                      break;
+            case 'U': INTARG(conf.streamcap, "stream-cap");
+                      break;
+            case 'u': INTARG(conf.clientcap, "client-cap");
+                      break;
+            case 'E': INTARG(conf.egresscap, "egress-cap");
+                      break;
 
             default:
                       exit(1);
@@ -152,7 +227,11 @@ int main (int argc, char *argv[]) {
     
     get_config(&conf, config_file);
     file_cache = cache_init(6000, conf.cachestripes, create_segment, NULL);
+    stream_set_sendfile_networks(conf.sendfile_nets);
     LOGGER(LOG_INFO, "cache at %p", file_cache);
+    respcache_init(conf.respcache);
+    if (conf.streamreaders > 0 && conf.chunksize > 0)
+        reader_init(conf.streamreaders, conf.chunksize);
 // unix specific initialization in system.c
 // TBD windows version
     if (flag_daemonize)
@@ -206,6 +285,8 @@ int main (int argc, char *argv[]) {
     db_init_status();
 // reset global DAAP sessions
     sessions_init();
+// PREFETCH thread: warms the tracks that follow the one a client plays
+    prefetch_init();
 // the rest of this is boilerplate LIBEVENT / EVHTP for a multi 
 // threaded, thread-pooling HTTP server.  Application specific 
 // callbacks are located in http.c
@@ -214,9 +295,24 @@ int main (int argc, char *argv[]) {
     LOGGER(LOG_INFO, "initialize evhtp_base...");
     parent.htp  = evhtp_new(parent.base, NULL);
     parent.config = &conf;
+    parent.streamhtp = NULL;
     register_callbacks(parent.htp);
     evhtp_use_threads_wexit(parent.htp, app_init_thread, app_term_thread, 
                             conf.threads, &parent);
+// song streams get event loops of their own, so that a long listing 
+// encoded on a metadata thread never holds up a chunk of audio
+    if (conf.streamport > 0) {
+        parent.streamhtp = evhtp_new(parent.base, NULL);
+        register_stream_callbacks(parent.streamhtp);
+        evhtp_use_threads_wexit(parent.streamhtp, app_init_thread, 
+                                app_term_thread, conf.streamthreads, &parent);
+        LOGGER(LOG_INFO, "binding stream socket %ld...", conf.streamport);
+        if (evhtp_bind_socket(parent.streamhtp, "0.0.0.0", conf.streamport, 
+                              2048) == -1) {
+            LOGGER(LOG_EMERG, "failed to bind stream socket error %d.", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
     /*
     int i = 0;
     evthr_t * evthr = NULL;
@@ -190,6 +190,8 @@ const meta_tag_t container_meta_tags[] = {
     "p.special_id",   MOFS(special_id)       },   
 { "dmap.persistentid",      T_LONG,   "mper", 
     "p.id",           MOFS(persistent_id)    },
+{ "dmap.itemcount",         T_INT,    "mimc", 
+    "p.items",        MOFS(item_count)       },
 { NULL, 0, NULL, NULL, 0 }
 };
 
@@ -203,6 +205,10 @@ const meta_tag_t group_meta_tags[] = {
     "g.name",         MOFS(title)            },
 { "dmap.persistentid",      T_LONG,   "mper", 
     "g.persistentid", MOFS(persistent_id)    },
+{ "dmap.itemcount",         T_INT,    "mimc", 
+    "g.items",        MOFS(item_count)       },
+{ "daap.songalbumartist",   T_STRING, "asaa", 
+    "g.album_artist", MOFS(album_artist)     },
 { NULL, 0, NULL, NULL, 0 }
 };
 const meta_tag_t misc_meta_tags[] = {
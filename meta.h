@@ -44,10 +44,15 @@ typedef struct meta_info_t {
         time_modified,
         rating,
         total_discs,
-        disc;
+        disc,
+        item_count,
+        art_type,
+        art_length,
+        unsynchronised;
     long persistent_id,
          songartistid,
-         songalbumid;
+         songalbumid,
+         art_offset;
     char *title,
          *album,
          *artist,
@@ -64,7 +69,8 @@ typedef struct meta_info_t {
          *artist_sort,
          *album_sort,
          *album_artist_sort,
-         *publisher;
+         *publisher,
+         *art_mime;
 } meta_info_t;
 
 #define MOFS(x) offsetof(meta_info_t, x)
@@ -0,0 +1,121 @@
+// The bitrate of an MPEG audio file, for pacing its streams.
+// The first frame after the ID3v2 tag is found by its sync word, and taken
+// as such only if another frame follows it where its length says.  A Xing
+// or Info header in that frame gives the frame count of the whole file, and
+// with it the average bitrate of a VBR file; otherwise the frame's own
+// bitrate is the file's.
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mpeg.h"
+
+#define SEARCH_BYTES 65536      // past the tag, for the first frame
+
+typedef struct mpeg_frame {
+    int version;                // 3: MPEG 1, 2: MPEG 2, 0: MPEG 2.5
+    int layer;                  // 1 to 3
+    int bitrate;                // kbps
+    int samplerate;
+    int samples;                // per frame
+    int mono;
+    int length;                 // bytes
+} mpeg_frame;
+
+static const short bitrates[2][3][15] = {
+  { // MPEG 1, layers I, II, III
+    { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+    { 0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
+    { 0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 }
+  },
+  { // MPEG 2 and 2.5
+    { 0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },
+    { 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 },
+    { 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 }
+  }
+};
+static const int samplerates[3] = { 44100, 48000, 32000 };
+
+static uint32_t _be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// decode a frame header.  free format frames are not handled.
+static int _frame(const unsigned char *p, mpeg_frame *f) {
+    uint32_t h = _be32(p);
+    if ((h & 0xffe00000) != 0xffe00000) return 0;
+    int version = (h >> 19) & 3, layer = 4 - ((h >> 17) & 3);
+    int bri = (h >> 12) & 15, sri = (h >> 10) & 3, pad = (h >> 9) & 1;
+    if (version == 1 || layer == 4 || bri == 0 || bri == 15 || sri == 3)
+        return 0;
+    f->version    = version;
+    f->layer      = layer;
+    f->bitrate    = bitrates[version != 3][layer - 1][bri];
+    f->samplerate = samplerates[sri] >> (version == 3 ? 0 :
+                                         version == 2 ? 1 : 2);
+    f->samples    = layer == 1 ? 384 :
+                    layer == 3 && version != 3 ? 576 : 1152;
+    f->mono       = ((h >> 6) & 3) == 3;
+    if (layer == 1)
+        f->length = (12000 * f->bitrate / f->samplerate + pad) * 4;
+    else
+        f->length = f->samples / 8 * 1000 * f->bitrate / f->samplerate + pad;
+    return 1;
+}
+
+// where the audio starts: past the ID3v2 tag and its footer, if any
+static off_t _audio_start(const unsigned char *p, size_t n) {
+    if (n < 10 || memcmp(p, "ID3", 3)) return 0;
+// the tag size is syncsafe: seven bits to the byte
+    off_t size = (p[6] & 0x7f) << 21 | (p[7] & 0x7f) << 14 |
+                 (p[8] & 0x7f) << 7  | (p[9] & 0x7f);
+    return 10 + size + ((p[5] & 0x10) ? 10 : 0);
+}
+
+/**
+ * @brief the bitrate of the MPEG audio file at path, averaged over the file
+ *        if it says how many frames it has.
+ * @return kbps, or 0 if no frame was found
+ */
+int mpeg_bitrate(const char *path) {
+    unsigned char buf[SEARCH_BYTES];
+    struct stat st;
+    int kbps = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = pread(fd, buf, 10, 0);
+    off_t start = n > 0 ? _audio_start(buf, n) : 0;
+    if (fstat(fd, &st) || (n = pread(fd, buf, sizeof(buf), start)) < 4) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    mpeg_frame f, next;
+    for (ssize_t i = 0; i + 4 <= n; i++) {
+        if (buf[i] != 0xff || !_frame(buf + i, &f)) continue;
+// a frame must be followed by a like one, unless the buffer ends first
+        ssize_t j = i + f.length;
+        if (j + 4 <= n && (!_frame(buf + j, &next) ||
+                           next.version != f.version ||
+                           next.layer != f.layer ||
+                           next.samplerate != f.samplerate))
+            continue;
+        kbps = f.bitrate;
+// the Xing or Info header follows layer III's side information
+        int side = f.version == 3 ? (f.mono ? 17 : 32) : (f.mono ? 9 : 17);
+        const unsigned char *x = buf + i + 4 + side;
+        if (f.layer == 3 && x + 12 <= buf + n &&
+            (!memcmp(x, "Xing", 4) || !memcmp(x, "Info", 4)) &&
+            (_be32(x + 4) & 1)) {
+            uint64_t frames = _be32(x + 8);
+            uint64_t bytes  = st.st_size - (start + i);
+            if (frames)
+                kbps = bytes * 8 * f.samplerate /
+                       (frames * f.samples * 1000);
+        }
+        break;
+    }
+    return kbps;
+}
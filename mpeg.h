@@ -0,0 +1,8 @@
+#ifndef __MPEG_H__
+#define __MPEG_H__
+
+// the bitrate of an mp3 file, read from its first frame header and its
+// Xing or Info header, if it has one.
+
+int mpeg_bitrate(const char *path);
+#endif
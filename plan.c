@@ -0,0 +1,294 @@
+// Compiled meta profiles.
+// Resolving a meta= parameter means a strdup, a split, and a linear scan of
+// the tag table per name; encoding a row then dispatched on the type of every
+// cell.  A plan does all of that once per distinct meta string and thread,
+// leaving only the per-column emitter calls in the row loop.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "dmap.h"
+#include "meta.h"
+#include "vector.h"
+#include "util.h"
+#include "sql.h"
+#include "plan.h"
+
+#define PLANS_PER_THREAD 16
+
+typedef void (*plan_emit)(DMAPBUF *b, sqlite3_stmt *stmt, 
+                          const plan_col_t *c, int row);
+typedef void (*plan_store)(sqlite3_stmt *stmt, const plan_col_t *c, 
+                           char *base);
+
+struct plan_col_t {
+    char        tag[4];
+    int         col;      // result column
+    size_t      ofs;      // in meta_info_t
+    size_t      size;     // encoded size, not counting string data
+    int         string;
+    plan_emit   emit;     // NULL if the column is not encoded
+    plan_store  store;
+};
+
+static void _emit_char(DMAPBUF *b, sqlite3_stmt *stmt, 
+                       const plan_col_t *c, int row) {
+    dmap_buf_char(b, c->tag, (char)sqlite3_column_int(stmt, c->col));
+}
+
+static void _emit_short(DMAPBUF *b, sqlite3_stmt *stmt, 
+                        const plan_col_t *c, int row) {
+    dmap_buf_short(b, c->tag, (short)sqlite3_column_int(stmt, c->col));
+}
+
+static void _emit_int(DMAPBUF *b, sqlite3_stmt *stmt, 
+                      const plan_col_t *c, int row) {
+    dmap_buf_int(b, c->tag, sqlite3_column_int(stmt, c->col));
+}
+
+static void _emit_long(DMAPBUF *b, sqlite3_stmt *stmt, 
+                       const plan_col_t *c, int row) {
+    dmap_buf_long(b, c->tag, sqlite3_column_int64(stmt, c->col));
+}
+
+static void _emit_string(DMAPBUF *b, sqlite3_stmt *stmt, 
+                         const plan_col_t *c, int row) {
+    const char *str = (const char *)sqlite3_column_text(stmt, c->col);
+    dmap_buf_string_n(b, c->tag, STR(str), sqlite3_column_bytes(stmt, c->col));
+}
+
+// dmap.containeritemid - replace it with place in results
+static void _emit_row(DMAPBUF *b, sqlite3_stmt *stmt, 
+                      const plan_col_t *c, int row) {
+    dmap_buf_int(b, c->tag, row + 1);
+}
+
+static void _store_char(sqlite3_stmt *stmt, const plan_col_t *c, char *base) {
+    *(char *)(base + c->ofs) = (char)sqlite3_column_int(stmt, c->col);
+}
+
+static void _store_short(sqlite3_stmt *stmt, const plan_col_t *c, char *base) {
+    *(short *)(base + c->ofs) = (short)sqlite3_column_int(stmt, c->col);
+}
+
+static void _store_int(sqlite3_stmt *stmt, const plan_col_t *c, char *base) {
+    *(int *)(base + c->ofs) = sqlite3_column_int(stmt, c->col);
+}
+
+static void _store_long(sqlite3_stmt *stmt, const plan_col_t *c, char *base) {
+    *(long *)(base + c->ofs) = sqlite3_column_int64(stmt, c->col);
+}
+
+static void _store_string(sqlite3_stmt *stmt, const plan_col_t *c, char *base) {
+    *(char **)(base + c->ofs) = (char *)sqlite3_column_text(stmt, c->col);
+}
+
+static void _compile_col(plan_col_t *c, const meta_tag_t *tag, 
+                         int col, int encode) {
+    memcpy(c->tag, tag->tag, 4);
+    c->col    = col;
+    c->ofs    = tag->ofs;
+    c->string = 0;
+    switch(tag->type) {
+        case T_CHAR:   c->size =  9; c->emit = _emit_char;  
+                       c->store = _store_char;   break;
+        case T_SHORT:  c->size = 10; c->emit = _emit_short; 
+                       c->store = _store_short;  break;
+        case T_DATE:
+        case T_INT:    c->size = 12; c->emit = _emit_int;   
+                       c->store = _store_int;    break;
+        case T_LONG:   c->size = 16; c->emit = _emit_long;  
+                       c->store = _store_long;   break;
+        case T_STRING: c->size =  8; c->emit = _emit_string; 
+                       c->store = _store_string; c->string = 1; break;
+        default:       c->size =  0; c->emit = NULL; 
+                       c->store = NULL;          break;
+    }
+    if (!strcmp(tag->tag, "mcti")) {
+        c->size   = 12;
+        c->emit   = _emit_row;
+        c->string = 0;
+        return;
+    }
+    if (!encode) {
+        c->size   = 0;
+        c->emit   = NULL;
+        c->string = 0;
+    }
+}
+
+static plan_t *_compile(plan_kind kind, const char *meta) {
+    const meta_tag_t *table;
+    const char **defaults;
+    const meta_tag_t *skip[3] = { NULL, NULL, NULL };
+    int (*find)(const char *);
+    query_t q;
+    q.type = Q_ITEMLIST;
+    plan_t *plan = calloc(1, sizeof(plan_t));
+    plan->meta = strdup(meta ? meta : "");
+    plan->kind = kind;
+    plan->refs = 1;  // the reference held by the thread's cache
+    vector_new(&plan->tags, 20);
+    switch(kind) {
+        case PLAN_CONTAINERS:
+            table    = container_meta_tags;
+            defaults = default_meta_container;
+            find     = meta_find_container_tag;
+            q.type   = Q_CONTAINERLIST;
+// to be able to tell if a playlist is "smart", we need at least this meta
+// tag, so if the client specifies metatags we need to make sure this is there
+            vector_pushback(&plan->tags, container_meta_tags); 
+// and the maintained item count, which containerlist_itemcb always sends
+            skip[0] = container_meta_tags + 
+                      meta_find_container_tag("dmap.itemcount");
+            vector_pushback(&plan->tags, skip[0]); 
+            plan->start_col = 2;
+            break;
+        case PLAN_GROUPS:
+            table    = group_meta_tags;
+            defaults = default_meta_group;
+            find     = meta_find_group_tag;
+            q.type   = Q_GROUPLIST;
+// the kind, count and album artist, which grouplist_itemcb sends itself
+            skip[0] = group_meta_tags;
+            skip[1] = group_meta_tags + meta_find_group_tag("dmap.itemcount");
+            skip[2] = group_meta_tags + 
+                      meta_find_group_tag("daap.songalbumartist");
+            for (int i = 0; i < 3; i++)
+                vector_pushback(&plan->tags, skip[i]);
+            plan->start_col = 3;
+            break;
+        default:
+            table    = item_meta_tags;
+            defaults = default_meta_items;
+            find     = meta_find_item_tag;
+            break;
+    }
+    char *raw_meta = NULL;
+    char **names = (char **)defaults;
+    int nmeta;
+    if (meta) {
+        raw_meta = strdup(meta);
+        meta_parse(raw_meta, &names, &nmeta);
+    }
+    for (int i = -1; names[++i]; ) {
+        int index = find(names[i]);
+        if (index >= 0) {
+            if (table + index != skip[0] && table + index != skip[1] &&
+                table + index != skip[2])
+                vector_pushback(&plan->tags, table + index);
+        }
+        else LOGGER(LOG_NOTICE, "unrecognized metatag: %s", names[i]);
+    }
+    if (raw_meta) {
+        free(names);
+        free(raw_meta);
+    }
+// tags without a db column produce no result column
+    plan->cols = calloc(plan->tags.used, sizeof(plan_col_t));
+    for (int i = 0; i < plan->tags.used; i++) {
+        const meta_tag_t *tag = plan->tags.data[i];
+        if (!tag->db_column) continue;
+        _compile_col(plan->cols + plan->ncols, tag, plan->ncols, 
+                     i >= plan->start_col);
+        plan->ncols++;
+    }
+    plan->columns = sql_column_list(&plan->tags);
+    vector order;
+    vector_new(&order, 1);
+    if (kind == PLAN_GROUPS)
+        vector_pushback(&order, GROUPLIST_ORDER);
+    sql_build_query_columns(&q, plan->columns, &order, &plan->select);
+    vector_free(&order);
+    LOGGER(LOG_INFO, "compiled %d column plan '%s'", plan->ncols, plan->meta);
+    return plan;
+}
+
+static void _free(plan_t *plan) {
+    vector_free(&plan->tags);
+    free(plan->cols);
+    free(plan->columns);
+    free(plan->select);
+    free(plan->meta);
+    free(plan);
+}
+
+/**
+ * @brief the compiled plan for a listing kind and meta= parameter, NULL 
+ *        for the default profile.  release it with plan_release().
+ */
+plan_t *plan_get(app *aux, plan_kind kind, const char *meta) {
+    int n = 0;
+    plan_t **p, *plan;
+    for (p = &aux->plans; *p; p = &(*p)->next, n++)
+        if ((*p)->kind == kind && !strcmp((*p)->meta, meta ? meta : "")) {
+// move to front
+            plan = *p;
+            *p = plan->next;
+            plan->next = aux->plans;
+            aux->plans = plan;
+            plan->refs++;
+            return plan;
+        }
+    plan = _compile(kind, meta);
+    plan->next = aux->plans;
+    aux->plans = plan;
+    if (++n > PLANS_PER_THREAD) {
+// drop the least recently used plan
+        for (p = &aux->plans; (*p)->next; p = &(*p)->next)
+            ;
+        plan_release(*p);
+        *p = NULL;
+    }
+    plan->refs++;
+    return plan;
+}
+
+void plan_release(plan_t *plan) {
+    if (--plan->refs == 0)
+        _free(plan);
+}
+
+void plan_free_all(app *aux) {
+    while (aux->plans) {
+        plan_t *next = aux->plans->next;
+        plan_release(aux->plans);
+        aux->plans = next;
+    }
+}
+
+/**
+ * @brief encode the current row of stmt into dest, without the enclosing
+ *        mlit.  if info is given, the column values are stored there too.
+ */
+void plan_put_row(plan_t *plan, DMAPBUF *dest, sqlite3_stmt *stmt, 
+                  int row, meta_info_t *info) {
+    const plan_col_t *c = plan->cols, *end = plan->cols + plan->ncols;
+    if (info) {
+        for (; c < end; c++) {
+            if (c->emit)  c->emit(dest, stmt, c, row);
+            if (c->store) c->store(stmt, c, (char *)info);
+        }
+    } else {
+        for (; c < end; c++)
+            if (c->emit)  c->emit(dest, stmt, c, row);
+    }
+}
+
+/**
+ * @brief the number of bytes plan_put_row() will encode for the current 
+ *        row of stmt, plus its enclosing mlit.
+ */
+size_t plan_row_size(plan_t *plan, sqlite3_stmt *stmt) {
+    size_t size = 8;
+    const plan_col_t *c = plan->cols, *end = plan->cols + plan->ncols;
+    for (; c < end; c++) {
+        size += c->size;
+        if (c->string) {
+            sqlite3_column_text(stmt, c->col);
+            size += sqlite3_column_bytes(stmt, c->col);
+        }
+    }
+    return size;
+}
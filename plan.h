@@ -0,0 +1,40 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+#include <sqlite3.h>
+#include "dmap.h"
+#include "meta.h"
+#include "vector.h"
+#include "util.h"
+
+// a listing's meta= profile compiled into an encoder: the resolved tags, 
+// one type specialized emitter per result column, and the generated 
+// SELECT.  plans are cached per evhtp thread, by kind and meta string.
+
+typedef enum plan_kind {
+    PLAN_ITEMS = 0,
+    PLAN_CONTAINERS,
+    PLAN_GROUPS
+} plan_kind;
+
+typedef struct plan_col_t plan_col_t;
+
+typedef struct plan_t {
+    struct plan_t *next;      // this thread's plans, most recent first
+    char          *meta;      // the meta= parameter, "" for the default
+    plan_kind      kind;
+    int            start_col; // columns before this are read, not encoded
+    vector         tags;      // meta_tag_t *, in column order
+    int            ncols;
+    plan_col_t    *cols;
+    char          *columns;   // the SELECT column list
+    char          *select;    // the listing query, without clauses
+    int            refs;
+} plan_t;
+
+plan_t *plan_get      (app *aux, plan_kind kind, const char *meta);
+void    plan_release  (plan_t *plan);
+void    plan_free_all (app *aux);
+void    plan_put_row  (plan_t *plan, DMAPBUF *dest, sqlite3_stmt *stmt,
+                       int row, meta_info_t *info);
+size_t  plan_row_size (plan_t *plan, sqlite3_stmt *stmt);
+#endif
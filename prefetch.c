@@ -0,0 +1,109 @@
+// Next track prefetch.
+// A stream that starts a song submits its id here without waiting.  The
+// prefetch thread finds the conf.prefetchtracks songs that follow it in
+// the playlist it was most recently added to, in playlistitems order, and
+// asks the kernel to read the first conf.prefetchsize MB of each ahead of
+// time.  Submissions are dropped rather than queued while the thread is
+// behind: a prefetch that comes late is worth nothing.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "config.h"
+#include "util.h"
+#include "sql.h"
+#include "writer.h"
+#include "prefetch.h"
+
+#define QUEUE_SIZE 16
+
+static int              queue[QUEUE_SIZE];
+static int              head = 0, count = 0;
+static int              running = 0;
+static pthread_mutex_t  prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   prefetch_cond  = PTHREAD_COND_INITIALIZER;
+
+// start reading the first conf.prefetchsize MB of the song into the page
+// cache.  the kernel reads it in the background; the file is closed at once.
+static void _warm(app *aux, int id) {
+    sqlite3_stmt *stmt = aux->stmts[Q_GET_PATH];
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        int fd = path ? open(path, O_RDONLY) : -1;
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, conf.prefetchsize << 20, POSIX_FADV_WILLNEED);
+            close(fd);
+            LOGGER(LOG_DEBUG, "    prefetched file %d", id);
+        }
+    }
+    sqlite3_reset(stmt);
+}
+
+static void _prefetch(app *aux, int id) {
+    sqlite3_stmt *stmt = aux->stmts[Q_NEXT_TRACKS];
+    int next[8], n = 0;
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_int(stmt, 2, conf.prefetchtracks);
+    while (n < 8 && sqlite3_step(stmt) == SQLITE_ROW)
+        next[n++] = sqlite3_column_int(stmt, 0);
+    sqlite3_reset(stmt);
+    for (int i = 0; i < n; i++)
+        _warm(aux, next[i]);
+}
+
+static void *_prefetch_thread(void *arg) {
+    app state;
+    memset(&state, 0, sizeof(state));
+    state.header = -1;
+    state.config = &conf;
+    wait_for_writer();
+    db_open_database(&state, SQLITE_OPEN_READONLY);
+    precompile_statements(&state);
+    while (1) {
+        pthread_mutex_lock(&prefetch_mutex);
+        while (!count)
+            pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+        int id = queue[head];
+        head = (head + 1) % QUEUE_SIZE;
+        count--;
+        pthread_mutex_unlock(&prefetch_mutex);
+        _prefetch(&state, id);
+    }
+    return NULL;
+}
+
+void prefetch_init() {
+    if (conf.prefetchtracks <= 0 || conf.prefetchsize <= 0)
+        return;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, _prefetch_thread, NULL)) {
+        LOGGER(LOG_ERR, "failed to start prefetch thread");
+        return;
+    }
+    pthread_detach(tid);
+    running = 1;
+    LOGGER(LOG_INFO, "prefetching %ld MB of the next %ld tracks",
+                     conf.prefetchsize, conf.prefetchtracks);
+}
+
+/**
+ * @brief warm the tracks after song id.  never blocks on the prefetch
+ *        thread.
+ */
+void prefetch_submit(int id) {
+    if (!running) return;
+    pthread_mutex_lock(&prefetch_mutex);
+    if (count < QUEUE_SIZE) {
+        queue[(head + count) % QUEUE_SIZE] = id;
+        count++;
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
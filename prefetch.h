@@ -0,0 +1,10 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+// when a song starts playing, the tracks after it in its playlist are
+// warmed into the page cache by a background thread, so that the client's
+// next request doesn't wait on the disk.
+
+void prefetch_init  ();
+void prefetch_submit(int id);
+#endif
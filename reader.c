@@ -0,0 +1,227 @@
+// Asynchronous chunk reads for song streams.
+// A stream on slow storage that hands the socket a file segment blocks its
+// event loop whenever sendfile meets a cold page, and with it every other
+// connection on that loop.  With conf.streamreaders set, streams instead
+// submit each chunk here.  A reader thread preads it into a buffer from a
+// shared pool, queues it on the submitting evhtp thread, and signals that
+// thread's eventfd.  The evhtp thread then runs the callback, which adds
+// the buffer to the connection by reference; the buffer goes back to the
+// pool once libevent has written it out.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "system.h"
+#include "reader.h"
+
+#define POOL_MAX  64        // free buffers kept for reuse
+
+struct reader_read_t {
+    int                 fd;
+    off_t               offset;
+    size_t              len;
+    unsigned char      *buf;
+    ssize_t             result;
+    reader_cb           cb;
+    void               *arg;       // NULL once cancelled
+    struct reader_t    *owner;
+    struct reader_read_t *next;
+};
+
+// the completions waiting for an evhtp thread
+typedef struct reader_t {
+    int                 efd;
+    struct event       *done;
+    pthread_mutex_t     mutex;
+    READ               *head, *tail;
+} reader_t;
+
+static pthread_mutex_t  queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   queue_cond  = PTHREAD_COND_INITIALIZER;
+static READ            *queue_head  = NULL, *queue_tail = NULL;
+
+static pthread_mutex_t  pool_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static void           **pool        = NULL;
+static int              npool       = 0;
+static size_t           buffer_size = 0;
+
+static unsigned char *_buffer_get() {
+    void *buf = NULL;
+    pthread_mutex_lock(&pool_mutex);
+    if (npool)
+        buf = pool[--npool];
+    pthread_mutex_unlock(&pool_mutex);
+    return buf ? buf : malloc(buffer_size);
+}
+
+static void _buffer_put(void *buf) {
+    pthread_mutex_lock(&pool_mutex);
+    if (npool < POOL_MAX) {
+        pool[npool++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    free(buf);
+}
+
+// called by libevent once a buffer has been written out
+static void _unref_cb(const void *data, size_t len, void *extra) {
+    _buffer_put((void *)data);
+}
+
+static void *_reader_thread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (!queue_head)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        READ *r = queue_head;
+        queue_head = r->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_mutex);
+
+        size_t got = 0;
+        r->result = 0;
+        while (got < r->len) {
+            ssize_t n = pread(r->fd, r->buf + got, r->len - got,
+                              r->offset + got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                got = 0;
+                r->result = -1;
+                break;
+            }
+            if (n == 0)
+                break;
+            got += n;
+        }
+        if (got)
+            r->result = got;
+
+        reader_t *rd = r->owner;
+        r->next = NULL;
+        pthread_mutex_lock(&rd->mutex);
+        if (rd->tail)
+            rd->tail->next = r;
+        else
+            rd->head = r;
+        rd->tail = r;
+        pthread_mutex_unlock(&rd->mutex);
+        uint64_t one = 1;
+        if (write(rd->efd, &one, sizeof(one)) < 0)
+            LOGGER(LOG_ERR, "failed to signal read completion: %s",
+                            strerror(errno));
+    }
+    return NULL;
+}
+
+// run the callbacks of the reads that have completed for this thread
+static void _done_cb(evutil_socket_t fd, short events, void *arg) {
+    reader_t *rd = (reader_t *)arg;
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+    pthread_mutex_lock(&rd->mutex);
+    READ *r = rd->head, *next;
+    rd->head = rd->tail = NULL;
+    pthread_mutex_unlock(&rd->mutex);
+    for (; r; r = next) {
+        next = r->next;
+        if (!r->arg || !r->cb(r, r->buf, r->result, r->arg))
+            _buffer_put(r->buf);
+        free(r);
+    }
+}
+
+/**
+ * @brief start the reader threads.  bufsize is the largest chunk a stream
+ *        will ask for.
+ */
+void reader_init(int threads, size_t bufsize) {
+    buffer_size = bufsize;
+    pool = calloc(POOL_MAX, sizeof(void *));
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, _reader_thread, NULL);
+        pthread_detach(tid);
+    }
+    LOGGER(LOG_INFO, "%d stream readers, %zu byte buffers", threads, bufsize);
+}
+
+void reader_init_thread(app *aux) {
+    reader_t *rd = calloc(1, sizeof(reader_t));
+    rd->efd = eventfd(0, EFD_NONBLOCK);
+    if (rd->efd < 0) {
+        LOGGER(LOG_ERR, "can't create eventfd, streams will read in the loop");
+        free(rd);
+        aux->reader = NULL;
+        return;
+    }
+    pthread_mutex_init(&rd->mutex, NULL);
+    rd->done = event_new(aux->base, rd->efd, EV_READ | EV_PERSIST,
+                         _done_cb, rd);
+    event_add(rd->done, NULL);
+    aux->reader = rd;
+}
+
+void reader_term_thread(app *aux) {
+    reader_t *rd = aux->reader;
+    if (!rd) return;
+// a read still in a reader thread's hands may yet queue itself here, so
+// the queue outlives the thread; the eventfd it signals is left open
+    event_free(rd->done);
+    aux->reader = NULL;
+}
+
+/**
+ * @brief read len bytes of fd at offset on a reader thread, and call cb
+ *        with them on this one.  len must not exceed the buffer size given
+ *        to reader_init().
+ * @return the read, for reader_cancel(), or NULL if this thread can't
+ *         take completions.
+ */
+READ *reader_submit(app *aux, int fd, off_t offset, size_t len,
+                    reader_cb cb, void *arg) {
+    if (!aux->reader || len > buffer_size) return NULL;
+    READ *r   = malloc(sizeof(READ));
+    r->fd     = fd;
+    r->offset = offset;
+    r->len    = len;
+    r->buf    = _buffer_get();
+    r->cb     = cb;
+    r->arg    = arg;
+    r->owner  = aux->reader;
+    r->next   = NULL;
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail)
+        queue_tail->next = r;
+    else
+        queue_head = r;
+    queue_tail = r;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    return r;
+}
+
+/**
+ * @brief the read's callback won't be run.  call it on the thread that
+ *        submitted the read, before the callback has run.
+ */
+void reader_cancel(READ *r) {
+    r->arg = NULL;
+}
+
+/**
+ * @brief add a buffer handed to a reader_cb to out, without a copy.  it is
+ *        returned to the pool once written.
+ */
+void reader_add_buffer(struct evbuffer *out, unsigned char *buf, size_t len) {
+    evbuffer_add_reference(out, buf, len, _unref_cb, NULL);
+}
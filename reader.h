@@ -0,0 +1,28 @@
+#ifndef __READER_H__
+#define __READER_H__
+#include <sys/types.h>
+#include <event2/buffer.h>
+#include "util.h"
+
+// chunks of songs read off the event loops.  a pool of reader threads
+// preads each chunk into a pooled buffer, and hands it back to the evhtp
+// thread that asked for it through that thread's eventfd, so a stream
+// only ever gives the socket bytes that are already in memory.
+
+typedef struct reader_read_t READ;
+
+// called on the thread that submitted the read, with the bytes read, 0 at
+// the end of the file, or -1 on an error.  returns 1 if it kept buf by
+// handing it to reader_add_buffer(), 0 to give it back.
+typedef int (*reader_cb)(READ *r, unsigned char *buf, ssize_t len,
+                         void *arg);
+
+void  reader_init        (int threads, size_t bufsize);
+void  reader_init_thread (app *aux);
+void  reader_term_thread (app *aux);
+READ *reader_submit      (app *aux, int fd, off_t offset, size_t len,
+                          reader_cb cb, void *arg);
+void  reader_cancel      (READ *r);
+void  reader_add_buffer  (struct evbuffer *out, unsigned char *buf,
+                          size_t len);
+#endif
@@ -0,0 +1,279 @@
+// A process wide cache of pre-encoded DMAP responses.
+// Entries are immutable once stored, and are handed to libevent by reference
+// so that neither a hit nor a store costs a copy, and a hit costs no SQL or
+// encoding.  Each entry
+// is reference counted: one reference is held by the cache itself, and one
+// by every output buffer the bytes have been added to.
+// An entry also keeps its gzip encoding once a client that accepts gzip has
+// asked for it, so a listing is compressed at most once per revision.
+// Once the cache is full, a new entry evicts the least recently used one.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+#include "system.h"
+#include "config.h"
+#include "dmap.h"
+#include "respcache.h"
+
+#define BUCKETS_PER_ENTRY 2
+
+typedef struct rc_entry {
+    char            *key;
+    uint64_t         revision;
+    unsigned char   *data;
+    size_t           len;
+    unsigned char   *volatile gz;  // set once, see _compress()
+    size_t           gzlen;
+    volatile int     nogz;         // too small, or doesn't compress
+    volatile int     refs;
+    struct rc_entry *next;
+    struct rc_entry *newer, *older;  // recency, under respcache_mutex
+} rc_entry;
+
+static rc_entry        **buckets  = NULL;
+static long              nbuckets = 0;
+static long              capacity = 0;
+static long              used     = 0;
+static rc_entry         *newest   = NULL;
+static rc_entry         *oldest   = NULL;
+static uint64_t          current_revision = 1;  // see db_revision
+static pthread_mutex_t   respcache_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long _hash(const char *key) {
+    unsigned long h = 5381;
+    int c;
+    while ((c = *key++))
+        h = ((h << 5) + h) + c;
+    return h;
+}
+
+static void _release(rc_entry *e) {
+    if (__sync_sub_and_fetch(&e->refs, 1) == 0) {
+        free(e->data);
+        free(e->gz);
+        free(e->key);
+        free(e);
+    }
+}
+
+// called by libevent once the referenced bytes have been written out
+static void _unref_cb(const void *data, size_t len, void *extra) {
+    _release((rc_entry *)extra);
+}
+
+// gzip the entry's bytes unless they are too small to be worth it.  two
+// threads may race to do it: both produce the same bytes, and the loser
+// frees its copy.
+static void _compress(rc_entry *e) {
+    if (e->gz || e->nogz) return;
+    if (conf.gziplevel <= 0 || e->len < (size_t)conf.gzipmin) {
+        e->nogz = 1;
+        return;
+    }
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+// 16 + MAX_WBITS for a gzip rather than a zlib header
+    if (deflateInit2(&z, conf.gziplevel, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        e->nogz = 1;
+        return;
+    }
+    size_t size = deflateBound(&z, e->len);
+    unsigned char *gz = malloc(size);
+    z.next_in   = e->data;
+    z.avail_in  = e->len;
+    z.next_out  = gz;
+    z.avail_out = size;
+    int ret = deflate(&z, Z_FINISH);
+    size_t gzlen = z.total_out;
+    deflateEnd(&z);
+    if (ret != Z_STREAM_END || gzlen >= e->len) {
+        free(gz);
+        e->nogz = 1;
+        return;
+    }
+    e->gzlen = gzlen;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&e->gz, NULL, gz))
+        free(gz);
+}
+
+// add the entry's bytes to out, gzipped if *gzip and worth it.  *gzip is
+// left set only if they were.  takes over a reference to e.
+static void _add(struct evbuffer *out, rc_entry *e, int *gzip) {
+    if (*gzip)
+        _compress(e);
+    if (*gzip && e->gz) {
+        evbuffer_add_reference(out, e->gz, e->gzlen, _unref_cb, e);
+    } else {
+        *gzip = 0;
+        evbuffer_add_reference(out, e->data, e->len, _unref_cb, e);
+    }
+}
+
+static void _lru_unlink(rc_entry *e) {
+    if (e->newer) e->newer->older = e->older;
+    else          newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else          oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+static void _lru_push(rc_entry *e) {
+    e->newer = NULL;
+    e->older = newest;
+    if (newest) newest->newer = e;
+    else        oldest = e;
+    newest = e;
+}
+
+// take the least recently used entry out of the cache
+static void _evict() {
+    rc_entry *e = oldest, **p;
+    if (!e) return;
+    for (p = &buckets[_hash(e->key) % nbuckets]; *p != e; p = &(*p)->next)
+        ;
+    *p = e->next;
+    _lru_unlink(e);
+    _release(e);
+    used--;
+}
+
+// a reference to the entry for key built at revision, or NULL.  a hit
+// becomes the most recently used entry.
+static rc_entry *_lookup(const char *key, uint64_t revision) {
+    rc_entry *e, *hit = NULL;
+    if (!buckets || !key) return NULL;
+    pthread_mutex_lock(&respcache_mutex);
+    if (revision == current_revision) {
+        for (e = buckets[_hash(key) % nbuckets]; e; e = e->next)
+            if (e->revision == revision && !strcmp(e->key, key)) {
+                hit = e;
+                __sync_add_and_fetch(&hit->refs, 1);
+                _lru_unlink(hit);
+                _lru_push(hit);
+                break;
+            }
+    }
+    pthread_mutex_unlock(&respcache_mutex);
+    return hit;
+}
+
+void respcache_init(long cap) {
+    pthread_mutex_lock(&respcache_mutex);
+    capacity = cap > 0 ? cap : 0;
+    nbuckets = capacity * BUCKETS_PER_ENTRY;
+    buckets  = nbuckets ? calloc(nbuckets, sizeof(rc_entry *)) : NULL;
+    used     = 0;
+    pthread_mutex_unlock(&respcache_mutex);
+    LOGGER(LOG_INFO, "response cache capacity %ld", capacity);
+}
+
+/**
+ * @brief drop every entry and start accepting entries built at revision.
+ *        entries still referenced by an output buffer are freed when
+ *        libevent is done with them.
+ */
+void respcache_invalidate(uint64_t revision) {
+    pthread_mutex_lock(&respcache_mutex);
+    current_revision = revision;
+    for (long i = 0; i < nbuckets; i++) {
+        rc_entry *e = buckets[i];
+        while (e) {
+            rc_entry *next = e->next;
+            _release(e);
+            e = next;
+        }
+        buckets[i] = NULL;
+    }
+    newest = oldest = NULL;
+    used = 0;
+    pthread_mutex_unlock(&respcache_mutex);
+}
+
+/**
+ * @brief add the cached response for key to out, if one exists that was
+ *        built at the given revision.  if *gzip is set the client accepts
+ *        gzip, and it is left set if the bytes added are gzipped.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int respcache_send(struct evbuffer *out, const char *key, uint64_t revision,
+                   int *gzip) {
+    rc_entry *hit = _lookup(key, revision);
+    if (!hit) return 0;
+    _add(out, hit, gzip);
+    return 1;
+}
+
+/**
+ * @brief whether the cached response for key would be sent gzipped to a
+ *        client that accepts it.
+ * @return 1 or 0, or -1 if no response for key is cached at revision
+ */
+int respcache_gzipped(const char *key, uint64_t revision) {
+    rc_entry *hit = _lookup(key, revision);
+    if (!hit) return -1;
+    _compress(hit);
+    int gzipped = hit->gz != NULL;
+    _release(hit);
+    return gzipped;
+}
+
+/**
+ * @brief hand the encoded body to out, and keep it in the cache under key
+ *        if the database has not been committed since revision was read.
+ *        a NULL key just hands it over.  body is left empty.  *gzip is as
+ *        for respcache_send().
+ * @return 1 if the response was cached, 0 otherwise.
+ */
+int respcache_store(struct evbuffer *out, const char *key,
+                    uint64_t revision, DMAPBUF *body, int *gzip) {
+    int cache = buckets && key;
+    if (!cache && !*gzip) {
+        dmap_buf_send(body, out);
+        return 0;
+    }
+    rc_entry *e = malloc(sizeof(rc_entry));
+    e->data     = dmap_buf_detach(body, &e->len);
+    e->key      = key ? strdup(key) : NULL;
+    e->revision = revision;
+    e->gz       = NULL;
+    e->gzlen    = 0;
+    e->nogz     = 0;
+    e->refs     = 1;  // the reference held by out
+    e->next     = NULL;
+    e->newer    = NULL;
+    e->older    = NULL;
+    int stored = 0;
+    pthread_mutex_lock(&respcache_mutex);
+    if (cache && revision == current_revision) {
+        rc_entry **slot = &buckets[_hash(key) % nbuckets];
+        rc_entry **p;
+// replace an entry with the same key, if another thread beat us to it
+        for (p = slot; *p; p = &(*p)->next)
+            if (!strcmp((*p)->key, key)) {
+                rc_entry *old = *p;
+                *p = old->next;
+                _lru_unlink(old);
+                _release(old);
+                used--;
+                break;
+            }
+        if (capacity) {
+            while (used >= capacity)
+                _evict();
+            e->refs++;    // the reference held by the cache
+            e->next = *slot;
+            *slot   = e;
+            _lru_push(e);
+            used++;
+            stored  = 1;
+        }
+    }
+    pthread_mutex_unlock(&respcache_mutex);
+    _add(out, e, gzip);
+    return stored;
+}
@@ -0,0 +1,20 @@
+#ifndef __RESPCACHE_H__
+#define __RESPCACHE_H__
+#include <stdint.h>
+#include <event2/buffer.h>
+#include "dmap.h"
+
+// a process wide cache of finished DMAP listing responses.  entries are
+// keyed by endpoint + normalized meta list and stamped with the database
+// revision they were built from.  the writer invalidates the whole cache
+// every time it commits.  responses are gzipped for clients that accept 
+// it, and the gzipped bytes are cached alongside.
+
+void     respcache_init      (long capacity);
+void     respcache_invalidate(uint64_t revision);
+int      respcache_send      (struct evbuffer *out, const char *key,
+                              uint64_t revision, int *gzip);
+int      respcache_store     (struct evbuffer *out, const char *key,
+                              uint64_t revision, DMAPBUF *body, int *gzip);
+int      respcache_gzipped   (const char *key, uint64_t revision);
+#endif
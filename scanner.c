@@ -9,6 +9,7 @@
 #include <libfswatch/c/libfswatch.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <fts.h>
 #include <sqlite3.h>
 #include "config.h"
@@ -22,6 +23,7 @@
 #include "system.h"
 #include "cache.h"
 #include "stream.h"
+#include "mpeg.h"
 
 #define CACHE_INITIAL_CAP    4096
 #define META_SCRATCH_SIZE    4096
@@ -151,6 +153,65 @@ static int process_text_tags(const id3_text *text, void *aux) {
     }
 }
 
+#define PICTURE_FRONT_COVER 3
+
+// a tag unsynchronised as a whole has a zero byte stuffed after every 0xff,
+// so no picture in it can be sent straight from the file
+static int process_header(id3_header *header, void *aux) {
+    meta_info_t *meta = (meta_info_t *)scratch_head((SCRATCH *)aux);
+    meta->unsynchronised = (header->flags & ID3_UNSYNCHRONISED) != 0;
+    return 0;
+}
+
+// APIC: encoding, mime type, picture type, description, then the picture.
+// the picture itself is left in the file, and only its offset kept.  the 
+// front cover is preferred, else the first picture.
+static int process_picture(ID3CB *id3, void *aux) {
+    SCRATCH     *s     = (SCRATCH *)aux;
+    meta_info_t *meta  = (meta_info_t *)scratch_head(s);
+    id3_frame   *frame = id3_current_frame(id3);
+    const char  *p     = frame->data, 
+                *end   = frame->data + frame->size;
+// a compressed, encrypted or unsynchronised picture can't be sent as it
+// is in the file
+    if (meta->unsynchronised || frame->size < 4 || frame->flags[1]) 
+        return 0;
+    int encoding = *p++;
+    const char *mime = p;
+    while (p < end && *p) p++;
+    size_t mlen = p - mime;
+    if (++p >= end) return 0;
+    int type = (unsigned char)*p++;
+// the description ends in a null, two of them in UTF-16
+    if (encoding == 1 || encoding == 2) {
+        while (p + 1 < end && (p[0] || p[1])) p += 2;
+        p += 2;
+    } else {
+        while (p < end && *p) p++;
+        p++;
+    }
+    if (p >= end || (mlen == 3 && !strncmp(mime, "-->", 3)))
+        return 0;  // a link rather than a picture
+    if (meta->art_length && 
+        (meta->art_type == PICTURE_FRONT_COVER || 
+         type != PICTURE_FRONT_COVER))
+        return 0;
+    meta->art_offset = id3_frame_offset(id3) + (p - frame->data);
+    meta->art_length = end - p;
+    meta->art_type   = type;
+// old taggers write "JPG" or "PNG" rather than a mime type
+    if (!memchr(mime, '/', mlen)) {
+        mime = (mlen == 3 && !strncasecmp(mime, "png", 3)) ? "image/png" 
+                                                           : "image/jpeg";
+        mlen = strlen(mime);
+    }
+    if ((meta->art_mime = scratch_get(s, mlen + 1))) {
+        memcpy(meta->art_mime, mime, mlen);
+        meta->art_mime[mlen] = '\0';
+    }
+    return 0;
+}
+
 static int add_file(app *aux, const char *fname, const char *path, ID3CB *id3, SCRATCH *meta_scratch, int parent) {
     LOGGER(LOG_INFO, "    add_file() %s/%s", path, fname);
     char *ext = strchr(fname, '.');
@@ -160,6 +221,7 @@ static int add_file(app *aux, const char *fname, const char *path, ID3CB *id3, S
         meta_info_t *meta = scratch_head(meta_scratch);
 
         id3_parse_file(id3, path, meta_scratch);
+        meta->bitrate = mpeg_bitrate(path);
         
         int artistid, albumartistid, albumid, genreid, publisherid;
         
@@ -197,12 +259,15 @@ static int add_file(app *aux, const char *fname, const char *path, ID3CB *id3, S
         int songid;
         void *cache;
         songid = db_upsert_song(aux, meta->title, pathid, artistid, albumid, 
-                genreid, meta->track, meta->disc, meta->song_length );
+                genreid, meta->track, meta->disc, meta->song_length,
+                meta->bitrate);
         if (cache = cache_set_and_get(file_cache, songid, path)) {
             LOGGER(LOG_INFO, "made cache segment [%d] %p %s", songid, cache, path);
         } else {
             LOGGER(LOG_ERR, "failed to make cache segment [%d] %p %s", songid, file_cache, path);
         }
+        db_set_artwork(songid, meta->art_offset, meta->art_length, 
+                       meta->art_mime);
         return 1;
 
     }
@@ -243,6 +308,8 @@ static int execute_scan(app *aux, char *path) {
     ID3CB *id3 = id3_new_parser(ID3_AUTOCONVERT_TO_UTF8);
 
     id3_set_all_texts_handler(id3, process_text_tags);
+    id3_set_header_handler(id3, process_header);
+    id3_set_frame_handler(id3, ID3_FRAME_PICTURE, process_picture);
     //id3_set_autoconvert_to_utf8(id3);
     
     SCRATCH *meta_scratch = scratch_new(META_SCRATCH_SIZE);
@@ -305,7 +372,7 @@ void  *scanner_thread(void *arg) {
     LOGGER(LOG_INFO, "scanner thread starting...");
     scanner_pid = pthread_self();
     //config_t *conf = (config_t *)arg;
-    app state;
+    app state = {0};
     state.header = -1;
     state.config = &conf;
 
@@ -0,0 +1,402 @@
+// Presorted permutations of the songs for sort= listings.
+// Each sort order is an immutable, reference counted array of song ids in
+// collation key order.  A key is case folded, prefers the artist and album
+// sort names, and carries the disc and track numbers fixed width, so keys
+// compare with strcmp().  A permutation is built in full by the first
+// request for its order.  From then on the writer keeps it current: after
+// each commit it reads the keys of the songs that commit wrote, and merges
+// them into a copy of the permutation in one pass, dropping the songs it
+// deleted.  A listing is then encoded in row order, and its items copied
+// out in the permutation's order.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "util.h"
+#include "sql.h"
+#include "plan.h"
+#include "dmap.h"
+#include "writer.h"
+#include "sortkeys.h"
+
+#define SORTS     (S_ARTIST + 1)
+#define FIELD_MAX 1024               // bytes of a name that are compared
+#define KEY_SIZE  (3 * FIELD_MAX + 16)
+
+typedef struct sortkey {
+    const char *key;
+    int         id;
+} sortkey;
+
+struct _sortkeys {
+    volatile int  refs;
+    uint64_t      revision;
+    int           maxid;
+    long          n;
+    sortkey      *keys;
+    char         *pool;
+};
+
+// a permutation being built: keys are offsets into the pool until it has
+// stopped moving
+typedef struct builder {
+    char   *pool;
+    size_t  used, size;
+    long    n, cap;
+    size_t *ofs;
+    int    *ids;
+} builder;
+
+static SORTKEYS        *current[SORTS];
+static pthread_mutex_t  sort_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  build_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *sort_names[SORTS] = { NULL, "name", "album", "artist" };
+
+/**
+ * @brief the sort order named by a sort= parameter
+ * @return the order, S_NONE if there is none or it isn't supported
+ */
+q_sort sortkeys_parse(const char *sort) {
+    if (!sort) return S_NONE;
+    for (int s = S_NAME; s < SORTS; s++)
+        if (!strcmp(sort, sort_names[s]))
+            return s;
+    return S_NONE;
+}
+
+void sortkeys_release(SORTKEYS *sk) {
+    if (sk && __sync_sub_and_fetch(&sk->refs, 1) == 0) {
+        free(sk->keys);
+        free(sk->pool);
+        free(sk);
+    }
+}
+
+// append the case folded name, or its sort name if it has one.  a name
+// without one loses a leading "the ", if article is set.
+static size_t _fold(char *buf, const char *sortname, const char *name,
+                    int article) {
+    const char *s = sortname && *sortname ? sortname : name;
+    size_t n = 0;
+    if (!s) return 0;
+    if (article && s == name && !strncasecmp(s, "the ", 4))
+        s += 4;
+    while (*s && n < FIELD_MAX)
+        buf[n++] = tolower((unsigned char)*s++);
+    return n;
+}
+
+static int _clamp(int n, int max) {
+    return n < 0 ? 0 : n > max ? max : n;
+}
+
+// the key of the current row of Q_SORT_KEYS or Q_SORT_CHANGES in buf
+static size_t _key(char *buf, q_sort sort, sqlite3_stmt *stmt) {
+#define TEXT(c) (const char *)sqlite3_column_text(stmt, c)
+    size_t n = 0;
+    switch (sort) {
+        case S_ARTIST:
+            n += _fold(buf + n, TEXT(4), TEXT(5), 1);
+            buf[n++] = '\1';
+// then as for album
+        case S_ALBUM:
+            n += _fold(buf + n, TEXT(2), TEXT(3), 1);
+            n += sprintf(buf + n, "\1%03d%04d\1",
+                         _clamp(sqlite3_column_int(stmt, 6), 999),
+                         _clamp(sqlite3_column_int(stmt, 7), 9999));
+// then as for name
+        default:
+            n += _fold(buf + n, NULL, TEXT(1), 0);
+            break;
+    }
+    buf[n] = '\0';
+    return n;
+#undef TEXT
+}
+
+static void _init(builder *b, long cap) {
+    b->used = 0;
+    b->size = 65536;
+    b->pool = malloc(b->size);
+    b->n    = 0;
+    b->cap  = cap > 0 ? cap : 1024;
+    b->ofs  = malloc(b->cap * sizeof(size_t));
+    b->ids  = malloc(b->cap * sizeof(int));
+}
+
+static void _add(builder *b, const char *key, size_t len, int id) {
+    if (b->n == b->cap) {
+        b->cap *= 2;
+        b->ofs = realloc(b->ofs, b->cap * sizeof(size_t));
+        b->ids = realloc(b->ids, b->cap * sizeof(int));
+    }
+    while (b->used + len + 1 > b->size)
+        b->pool = realloc(b->pool, b->size *= 2);
+    memcpy(b->pool + b->used, key, len + 1);
+    b->ofs[b->n] = b->used;
+    b->ids[b->n] = id;
+    b->used += len + 1;
+    b->n++;
+}
+
+static int _compare(const void *a, const void *b) {
+    const sortkey *x = a, *y = b;
+    int c = strcmp(x->key, y->key);
+    return c ? c : x->id - y->id;
+}
+
+// the builder's keys as a permutation, sorting them unless they already are
+static SORTKEYS *_finish(builder *b, uint64_t revision, int sorted) {
+    SORTKEYS *sk = malloc(sizeof(SORTKEYS));
+    sk->refs     = 1;  // the reference held by current, or the caller
+    sk->revision = revision;
+    sk->maxid    = 0;
+    sk->n        = b->n;
+    sk->pool     = b->pool;
+    sk->keys     = malloc((b->n ? b->n : 1) * sizeof(sortkey));
+    for (long i = 0; i < b->n; i++) {
+        sk->keys[i].key = b->pool + b->ofs[i];
+        sk->keys[i].id  = b->ids[i];
+        if (b->ids[i] > sk->maxid) sk->maxid = b->ids[i];
+    }
+    free(b->ofs);
+    free(b->ids);
+    if (!sorted)
+        qsort(sk->keys, sk->n, sizeof(sortkey), _compare);
+    return sk;
+}
+
+static SORTKEYS *_build(app *aux, q_sort sort, uint64_t revision) {
+    sqlite3_stmt *stmt = aux->stmts[Q_SORT_KEYS];
+    char key[KEY_SIZE];
+    builder b;
+    _init(&b, 0);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+        _add(&b, key, _key(key, sort, stmt), sqlite3_column_int(stmt, 0));
+    sqlite3_reset(stmt);
+    LOGGER(LOG_INFO, "built %s sort keys of %ld songs at revision %lu",
+                     sort_names[sort], b.n, (unsigned long)revision);
+    return _finish(&b, revision, 0);
+}
+
+static int _marked(const uint64_t *bits, long nwords, int id) {
+    return id / 64 < nwords && (bits[id / 64] >> (id % 64) & 1);
+}
+
+// old without the songs marked in gone, merged with fresh
+static SORTKEYS *_merge(SORTKEYS *old, SORTKEYS *fresh,
+                        const uint64_t *gone, long nwords,
+                        uint64_t revision) {
+    builder b;
+    long i = 0, j = 0;
+    _init(&b, old->n + fresh->n);
+    while (i < old->n || j < fresh->n) {
+        const sortkey *k;
+        if (i < old->n && _marked(gone, nwords, old->keys[i].id)) {
+            i++;
+            continue;
+        }
+        if (j == fresh->n ||
+            (i < old->n && _compare(old->keys + i, fresh->keys + j) < 0))
+            k = old->keys + i++;
+        else
+            k = fresh->keys + j++;
+        _add(&b, k->key, strlen(k->key), k->id);
+    }
+    return _finish(&b, revision, 1);
+}
+
+// make sk the current permutation for sort, dropping the one it replaces
+static void _publish(q_sort sort, SORTKEYS *sk) {
+    pthread_mutex_lock(&sort_mutex);
+    SORTKEYS *old = current[sort];
+    current[sort] = sk;
+    pthread_mutex_unlock(&sort_mutex);
+    sortkeys_release(old);
+}
+
+/**
+ * @brief the current permutation for a sort order, building it first if
+ *        no listing has been sorted that way yet.  release it with
+ *        sortkeys_release().
+ * @return the permutation, or NULL for S_NONE and S_PLAYLIST
+ */
+SORTKEYS *sortkeys_get(app *aux, q_sort sort) {
+    SORTKEYS *sk;
+    if (sort <= S_NONE || sort >= SORTS) return NULL;
+    pthread_mutex_lock(&sort_mutex);
+    if ((sk = current[sort]))
+        __sync_add_and_fetch(&sk->refs, 1);
+    pthread_mutex_unlock(&sort_mutex);
+    if (sk) return sk;
+    pthread_mutex_lock(&build_mutex);
+    pthread_mutex_lock(&sort_mutex);
+    if ((sk = current[sort]))
+        __sync_add_and_fetch(&sk->refs, 1);
+    pthread_mutex_unlock(&sort_mutex);
+    if (!sk) {
+// read before the keys, so they are at least as new as this revision
+        sk = _build(aux, sort, db_current_revision());
+        __sync_add_and_fetch(&sk->refs, 1);  // the caller's reference
+        _publish(sort, sk);
+    }
+    pthread_mutex_unlock(&build_mutex);
+    return sk;
+}
+
+/**
+ * @brief the writer calls this once it has committed a revision, to merge
+ *        the songs it wrote into the permutations in use.  one that has
+ *        missed a revision is rebuilt instead.
+ */
+void sortkeys_refresh(app *aux, uint64_t revision) {
+    SORTKEYS *old[SORTS] = { NULL };
+    builder fresh[SORTS];
+    uint64_t *gone = NULL;
+    long nwords = 0, nchanged = 0;
+    int used = 0;
+    char key[KEY_SIZE];
+    pthread_mutex_lock(&build_mutex);
+    pthread_mutex_lock(&sort_mutex);
+    for (int s = S_NAME; s < SORTS; s++)
+        if ((old[s] = current[s])) {
+            __sync_add_and_fetch(&old[s]->refs, 1);
+            used = 1;
+        }
+    pthread_mutex_unlock(&sort_mutex);
+    if (!used) {
+        pthread_mutex_unlock(&build_mutex);
+        return;
+    }
+    for (int s = S_NAME; s < SORTS; s++)
+        if (old[s]) _init(&fresh[s], 64);
+    sqlite3_stmt *stmt = aux->stmts[Q_SORT_CHANGES];
+    sqlite3_bind_int64(stmt, 1, revision);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int id = sqlite3_column_int(stmt, 8);
+        if (id < 0) continue;
+        if (id / 64 >= nwords) {
+            long n = (id / 64 + 1) * 2;
+            gone = realloc(gone, n * sizeof(uint64_t));
+            memset(gone + nwords, 0, (n - nwords) * sizeof(uint64_t));
+            nwords = n;
+        }
+        gone[id / 64] |= 1ULL << (id % 64);
+        nchanged++;
+// a song that still exists goes back in under its new key
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) continue;
+        for (int s = S_NAME; s < SORTS; s++)
+            if (old[s])
+                _add(&fresh[s], key, _key(key, s, stmt), id);
+    }
+    sqlite3_reset(stmt);
+    for (int s = S_NAME; s < SORTS; s++) {
+        if (!old[s]) continue;
+        SORTKEYS *f = _finish(&fresh[s], revision, 0);
+        if (old[s]->revision >= revision) {
+// built by a request after this commit
+        } else if (old[s]->revision + 1 < revision) {
+            _publish(s, _build(aux, s, revision));
+        } else if (nchanged) {
+            _publish(s, _merge(old[s], f, gone, nwords, revision));
+        } else {
+            pthread_mutex_lock(&sort_mutex);
+            old[s]->revision = revision;
+            pthread_mutex_unlock(&sort_mutex);
+        }
+        sortkeys_release(f);
+        sortkeys_release(old[s]);
+    }
+    pthread_mutex_unlock(&build_mutex);
+    if (nchanged)
+        LOGGER(LOG_INFO, "merged %ld changed songs into sort keys", nchanged);
+    free(gone);
+}
+
+/**
+ * @brief encode a listing query that selects SORTKEYS_COLUMN after the
+ *        plan's columns, in the order of sk.  its items are encoded in
+ *        row order and then copied out in sk's order, followed by any rows
+ *        of songs written since sk was built.  an index= of the form a-b,
+ *        a- or a selects the items at those positions of the sorted
+ *        listing.  *total is set to the number of rows in the listing.
+ * @return the number of items encoded into dest, or -1 on error
+ */
+int sortkeys_put_results(DMAPBUF *dest, app *aux, plan_t *plan,
+                         const char *sqlstr, int *bindvar, SORTKEYS *sk,
+                         const char *index, int *total) {
+    sqlite3_stmt *stmt = sql_open_results(aux, sqlstr, bindvar);
+    if (!stmt) return -1;
+    DMAPBUF *items = dmap_buf_new(65536);
+    long n = 0, cap = 1024;
+    int maxid = sk->maxid;
+    int *ids = malloc(cap * sizeof(int));
+    size_t *ofs = malloc((cap + 1) * sizeof(size_t));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (n == cap) {
+            cap *= 2;
+            ids = realloc(ids, cap * sizeof(int));
+            ofs = realloc(ofs, (cap + 1) * sizeof(size_t));
+        }
+        ids[n] = sqlite3_column_int(stmt, plan->ncols);
+        if (ids[n] > maxid) maxid = ids[n];
+        ofs[n] = dmap_buf_length(items);
+        size_t item = dmap_buf_open_list(items, "mlit");
+        plan_put_row(plan, items, stmt, n, NULL);
+        dmap_buf_close_list(items, item);
+        n++;
+    }
+    ofs[n] = dmap_buf_length(items);
+    sql_close_results(aux, stmt);
+    long first = 0, last = n - 1;
+    if (index) {
+        char dash = 0;
+        int got = sscanf(index, "%ld%c%ld", &first, &dash, &last);
+        if (got < 1 || first < 0) first = 0;
+        if (got == 1) last = first;
+        if (got == 2) last = n - 1;
+    }
+// the rows of each song, in row order.  a playlist can list a song twice.
+    int *head = malloc((maxid + 1) * sizeof(int));
+    int *next = malloc((n ? n : 1) * sizeof(int));
+    memset(head, 0xff, (maxid + 1) * sizeof(int));
+    for (long i = n - 1; i >= 0; i--) {
+        next[i] = head[ids[i]];
+        head[ids[i]] = i;
+    }
+    size_t len;
+    unsigned char *data = dmap_buf_detach(items, &len);
+    long pos = 0;
+    int nitems = 0;
+#define EMIT(row) do { \
+        if (pos >= first && pos <= last) { \
+            dmap_buf_append(dest, data + ofs[row], ofs[(row) + 1] - ofs[row]); \
+            nitems++; \
+        } \
+        pos++; \
+    } while (0)
+    for (long k = 0; k < sk->n; k++) {
+        int id = sk->keys[k].id;
+        for (int r = head[id]; r >= 0; r = next[r])
+            EMIT(r);
+        head[id] = -2;
+    }
+    for (long i = 0; i < n; i++)
+        if (head[ids[i]] != -2)
+            EMIT(i);
+#undef EMIT
+    *total = n;
+    free(data);
+    free(head);
+    free(next);
+    free(ids);
+    free(ofs);
+    dmap_buf_free(items);
+    return nitems;
+}
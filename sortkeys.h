@@ -0,0 +1,27 @@
+#ifndef __SORTKEYS_H__
+#define __SORTKEYS_H__
+#include <stdint.h>
+#include "dmap.h"
+#include "plan.h"
+#include "sql.h"
+#include "util.h"
+
+// sort= on item listings.  the songs are kept in each sort order as a
+// permutation of their ids, by collation keys built from the artist and
+// album sort names where present.  the writer merges the songs of each
+// commit into the permutations that are in use.  a sorted listing selects
+// the song id after the plan's columns, and is emitted in the order of the
+// permutation, so SQLite never sorts it.
+
+typedef struct _sortkeys SORTKEYS;
+
+#define SORTKEYS_COLUMN ", s.id"
+
+q_sort    sortkeys_parse      (const char *sort);
+SORTKEYS *sortkeys_get        (app *aux, q_sort sort);
+void      sortkeys_release    (SORTKEYS *sk);
+void      sortkeys_refresh    (app *aux, uint64_t revision);
+int       sortkeys_put_results(DMAPBUF *dest, app *aux, plan_t *plan,
+                               const char *sqlstr, int *bindvar,
+                               SORTKEYS *sk, const char *index, int *total);
+#endif
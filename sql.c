@@ -10,6 +10,8 @@
 #include "sql.h"
 #include "meta.h"
 #include "util.h"
+#include "filter.h"
+#include "keyset.h"
 
 
 const sql_t queries[] = {
@@ -51,6 +53,12 @@ const sql_t queries[] = {
         "FROM   songs "\
         "WHERE  artist = (SELECT id from artists where artist=?);"
     },
+    { "Q_SMART_PLAYLISTS",
+        "SELECT id, query "\
+        "FROM   playlists "\
+        "WHERE  type = 2 "\
+        "AND    query IS NOT NULL AND query != '(NULL)';"
+    },
     { "Q_SMARTPL_QUERY",
         "SELECT query "\
         "FROM   playlists p "\
@@ -129,12 +137,13 @@ const sql_t queries[] = {
     },
     { "Q_UPSERT_SONG",
         "WITH new (path, artist, album, genre, track, disc, \n"\
-        "          song_length, title) \n"\
-        "AS ( VALUES(?, ?, ?, ?, ?, ?, ?, ?) ) \n"\
+        "          song_length, bitrate, title) \n"\
+        "AS ( VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?) ) \n"\
         "INSERT OR REPLACE INTO songs (id, title, path, artist, album, \n"\
-        "genre, track, disc, song_length) \n"\
+        "genre, track, disc, song_length, bitrate) \n"\
         "SELECT old.id, new.title, new.path, new.artist, new.album, \n"\
-        "       new.genre, new.track, new.disc, new.song_length \n"\
+        "       new.genre, new.track, new.disc, new.song_length, \n"\
+        "       new.bitrate \n"\
         "FROM new LEFT JOIN songs AS old \n"\
         "ON new.path = old.path; "
     },
@@ -201,6 +210,91 @@ const sql_t queries[] = {
     { "Q_FIND_SONG",
       ""
     },
+    { "Q_BROWSE_ARTISTS",
+      "SELECT DISTINCT ar.artist FROM songs s, artists ar \n"\
+      "WHERE  s.artist = ar.id AND ar.id != 0;"
+    },
+    { "Q_BROWSE_ALBUMS",
+      "SELECT DISTINCT al.album FROM songs s, albums al \n"\
+      "WHERE  s.album = al.id AND al.id != 0;"
+    },
+    { "Q_BROWSE_GENRES",
+      "SELECT DISTINCT g.genre FROM songs s, genres g \n"\
+      "WHERE  s.genre = g.id AND g.id != 0;"
+    },
+    { "Q_BROWSE_COMPOSERS",
+      "SELECT DISTINCT composer FROM songs \n"\
+      "WHERE  composer IS NOT NULL AND composer != '';"
+    },
+    { "Q_FILTER_INDEX",
+      "SELECT s.id, ar.artist, al.album, g.genre, al.year, c.codectype, \n"\
+      "       s.title, s.album \n"\
+      "FROM   songs s, artists ar, albums al, genres g, codecs c \n"\
+      "WHERE  s.artist = ar.id AND s.album = al.id \n"\
+      "AND    s.genre = g.id AND s.codec = c.id;"
+    },
+    { "Q_SORT_KEYS",
+      "SELECT s.id, s.title, al.album_sort, al.album, ar.artist_sort, \n"\
+      "       ar.artist, s.disc, s.track \n"\
+      "FROM   songs s \n"\
+      "LEFT JOIN albums  al ON s.album  = al.id \n"\
+      "LEFT JOIN artists ar ON s.artist = ar.id;"
+    },
+    { "Q_SORT_CHANGES",
+      "SELECT s.id, s.title, al.album_sort, al.album, ar.artist_sort, \n"\
+      "       ar.artist, s.disc, s.track, ch.song \n"\
+      "FROM   changes ch \n"\
+      "LEFT JOIN songs   s  ON ch.song  = s.id \n"\
+      "LEFT JOIN albums  al ON s.album  = al.id \n"\
+      "LEFT JOIN artists ar ON s.artist = ar.id \n"\
+      "WHERE  ch.revision = ?;"
+    },
+    { "Q_GET_REVISION",
+      "SELECT rev FROM revision;"
+    },
+    { "Q_SET_REVISION",
+      "UPDATE revision SET rev = ?;"
+    },
+    { "Q_DELETED_SINCE",
+      "SELECT song FROM changes \n"\
+      "WHERE  deleted = 1 AND revision > ? AND revision <= ?;"
+    },
+    { "Q_SET_ARTWORK",
+      "INSERT OR REPLACE INTO artwork (song, length, start, mime) \n"\
+      "VALUES (?, ?, ?, ?);"
+    },
+    { "Q_REMOVE_ARTWORK",
+      "DELETE FROM artwork WHERE song = ?;"
+    },
+    { "Q_ITEM_ARTWORK",
+      "SELECT song, start, length, mime FROM artwork WHERE song = ?;"
+    },
+// a group's picture is that of its first track that has one
+    { "Q_GROUP_ARTWORK",
+      "SELECT aw.song, aw.start, aw.length, aw.mime \n"\
+      "FROM   groups g, songs s, artwork aw \n"\
+      "WHERE  g.id = ? AND aw.song = s.id \n"\
+      "AND   ((g.type = 1 AND s.album = g.ref) OR \n"\
+      "       (g.type = 2 AND s.artist = g.ref)) \n"\
+      "ORDER  BY s.disc, s.track, s.id LIMIT 1;"
+    },
+    { "Q_STREAM_INFO",
+      "SELECT bitrate, song_length FROM songs WHERE id = ?;"
+    },
+    { "Q_NEXT_TRACKS",
+      "SELECT n.songid "\
+      "FROM   playlistitems p, playlistitems n "\
+      "WHERE  p.id = (SELECT MAX(id) FROM playlistitems WHERE songid = ?1) "\
+      "AND    n.playlistid = p.playlistid AND n.id > p.id "\
+      "ORDER  BY n.id LIMIT ?2;"
+    },
+// the songs written or deleted by the open transaction leave every smart
+// playlist, and Q_SMART_ITEMS puts back those that still match
+    { "Q_SMART_UNCOUNT",
+      "DELETE FROM smartitems WHERE songid IN \n"\
+      "      (SELECT ch.song FROM changes ch, revision r \n"\
+      "       WHERE ch.revision = r.rev);"
+    },
     { "Q_BEGIN_TRANSACTION",
       "BEGIN TRANSACTION;"
     },
@@ -222,18 +316,27 @@ const sql_t queries[] = {
     },
     { "Q_CONTAINERITEMS",
         "SELECT %s "\
-        "FROM   files f, "\
-        "       playlistitems pi "
+        "FROM   playlistitems pi \n"\
+        "JOIN   songs s   ON pi.songid = s.id \n"\
+        "JOIN   artists ar ON s.artist = ar.id \n"\
+        "JOIN   albums al ON s.album  = al.id \n"\
+        "JOIN   genres g  ON s.genre  = g.id \n"\
+        "JOIN   codecs c  ON s.codec  = c.id "
     },
     { "Q_GROUPLIST",
         "SELECT %s "\
         "FROM   groups g "\
-        "WHERE  g.type = ? "
+        "WHERE  g.type = ? AND g.items > 1 AND g.ref != 0 "
     },
     { "Q_COUNT_SMART",
         "SELECT COUNT(*) "\
         "FROM "
     },
+// the smart playlist's query, then either nothing or SMART_CHANGED
+    { "Q_SMART_ITEMS",
+        "INSERT OR IGNORE INTO smartitems (playlistid, songid) "\
+        "SELECT ?, s.id FROM songs s WHERE (%s) %s;"
+    },
     { "Q_MAX",
         NULL
     },
@@ -251,8 +354,12 @@ const char *table_strings[] = {
     /* T_PLAYLISTS     */ "playlists pl",
     /* T_PLAYLISTITEMS */ "songs s, playlistitems pi",
     /* T_TEMP          */ "t_temp",
-    /* T_MAX           */ NULL,
+    /* T_PLAYS         */ "plays pl",
     /* T_GROUPS        */ "groups gr",
+    /* T_CHANGES       */ "changes ch",
+    /* T_ARTWORK       */ "artwork aw",
+    /* T_SMARTITEMS    */ "smartitems si",
+    /* T_MAX           */ NULL,
     /* T_INOTIFY       */ "inotify i",
     /* T_PAIRINGS      */ "pairings pg",
     /* T_SPEAKERS      */ "speakers s",
@@ -412,7 +519,24 @@ const sql_t tables[] = {
         "    playlistid    INTEGER NOT NULL REFERENCES playlists (id),\n"\
         "    songid        INTEGER NOT NULL REFERENCES songs     (id)\n"\
         "); \n"\
-        "CREATE INDEX IF NOT EXISTS idx_pli ON playlistitems(playlistid, songid);"
+        "CREATE INDEX IF NOT EXISTS idx_pli ON playlistitems(playlistid, songid);\n"\
+        "CREATE INDEX IF NOT EXISTS idx_pli_song ON playlistitems(songid);\n"\
+        "CREATE TRIGGER IF NOT EXISTS pli_ins AFTER INSERT ON playlistitems \n"\
+        "      BEGIN UPDATE playlists SET items = items + 1 \n"\
+        "            WHERE id = NEW.playlistid; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS pli_del AFTER DELETE ON playlistitems \n"\
+        "      BEGIN UPDATE playlists SET items = items - 1 \n"\
+        "            WHERE id = OLD.playlistid; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS pli_upd AFTER UPDATE OF playlistid \n"\
+        "      ON playlistitems \n"\
+        "      BEGIN UPDATE playlists SET items = items - 1 \n"\
+        "            WHERE id = OLD.playlistid; \n"\
+        "            UPDATE playlists SET items = items + 1 \n"\
+        "            WHERE id = NEW.playlistid; END; \n"\
+        "   UPDATE playlists SET items = \n"\
+        "   (SELECT COUNT(*) FROM playlistitems pi \n"\
+        "    WHERE pi.playlistid = playlists.id) \n"\
+        "   WHERE type != 2;"
     },
     { "t_temp",
         "CREATE TABLE IF NOT EXISTS t_temp(id INTEGER);"
@@ -424,6 +548,182 @@ const sql_t tables[] = {
         "    ts             TIMESTAMP DEFAULT CURRENT_TIMESTAMP \n"\
         ");"
     },
+// album (type 1) and artist (type 2) groups, kept up to date by triggers
+// as songs come and go.  the writer connection has recursive_triggers on,
+// so the delete half of an INSERT OR REPLACE is counted too.  the inserts
+// test NOT EXISTS rather than using OR IGNORE, since a trigger takes the
+// conflict policy of the statement that fired it.
+    { "groups",
+        "CREATE TABLE IF NOT EXISTS groups (\n"\
+        "    id            INTEGER PRIMARY KEY NOT NULL,\n"\
+        "    type          INTEGER NOT NULL,\n"\
+        "    ref           INTEGER NOT NULL,\n"\
+        "    name          VARCHAR(1024) DEFAULT NULL,\n"\
+        "    album_artist  VARCHAR(1024) DEFAULT NULL,\n"\
+        "    items         INTEGER DEFAULT 0,\n"\
+        "    persistentid  INTEGER DEFAULT 0,\n"\
+        "    UNIQUE(type, ref) \n"\
+        "); \n"\
+        "CREATE INDEX IF NOT EXISTS idx_groups_name ON groups(type, name);\n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_son_ins AFTER INSERT ON songs \n"\
+        "      BEGIN \n"\
+        "      INSERT INTO groups \n"\
+        "             (type, ref, name, album_artist, persistentid) \n"\
+        "      SELECT 1, al.id, al.album, ar.artist, (1 << 40) | al.id \n"\
+        "      FROM   albums al LEFT JOIN artists ar \n"\
+        "      ON     ar.id = al.album_artist WHERE al.id = NEW.album \n"\
+        "      AND    NOT EXISTS (SELECT 1 FROM groups \n"\
+        "                         WHERE type = 1 AND ref = NEW.album); \n"\
+        "      INSERT INTO groups \n"\
+        "             (type, ref, name, persistentid) \n"\
+        "      SELECT 2, ar.id, ar.artist, (2 << 40) | ar.id \n"\
+        "      FROM   artists ar WHERE ar.id = NEW.artist \n"\
+        "      AND    NOT EXISTS (SELECT 1 FROM groups \n"\
+        "                         WHERE type = 2 AND ref = NEW.artist); \n"\
+        "      UPDATE groups SET items = items + 1 \n"\
+        "      WHERE  (type = 1 AND ref = NEW.album) \n"\
+        "      OR     (type = 2 AND ref = NEW.artist); \n"\
+        "      END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_son_del AFTER DELETE ON songs \n"\
+        "      BEGIN \n"\
+        "      UPDATE groups SET items = items - 1 \n"\
+        "      WHERE  (type = 1 AND ref = OLD.album) \n"\
+        "      OR     (type = 2 AND ref = OLD.artist); \n"\
+        "      DELETE FROM groups WHERE items <= 0 \n"\
+        "      AND   ((type = 1 AND ref = OLD.album) \n"\
+        "      OR     (type = 2 AND ref = OLD.artist)); \n"\
+        "      END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_son_upd \n"\
+        "      AFTER UPDATE OF album, artist ON songs \n"\
+        "      BEGIN \n"\
+        "      UPDATE groups SET items = items - 1 \n"\
+        "      WHERE  (type = 1 AND ref = OLD.album) \n"\
+        "      OR     (type = 2 AND ref = OLD.artist); \n"\
+        "      DELETE FROM groups WHERE items <= 0 \n"\
+        "      AND   ((type = 1 AND ref = OLD.album) \n"\
+        "      OR     (type = 2 AND ref = OLD.artist)); \n"\
+        "      INSERT INTO groups \n"\
+        "             (type, ref, name, album_artist, persistentid) \n"\
+        "      SELECT 1, al.id, al.album, ar.artist, (1 << 40) | al.id \n"\
+        "      FROM   albums al LEFT JOIN artists ar \n"\
+        "      ON     ar.id = al.album_artist WHERE al.id = NEW.album \n"\
+        "      AND    NOT EXISTS (SELECT 1 FROM groups \n"\
+        "                         WHERE type = 1 AND ref = NEW.album); \n"\
+        "      INSERT INTO groups \n"\
+        "             (type, ref, name, persistentid) \n"\
+        "      SELECT 2, ar.id, ar.artist, (2 << 40) | ar.id \n"\
+        "      FROM   artists ar WHERE ar.id = NEW.artist \n"\
+        "      AND    NOT EXISTS (SELECT 1 FROM groups \n"\
+        "                         WHERE type = 2 AND ref = NEW.artist); \n"\
+        "      UPDATE groups SET items = items + 1 \n"\
+        "      WHERE  (type = 1 AND ref = NEW.album) \n"\
+        "      OR     (type = 2 AND ref = NEW.artist); \n"\
+        "      END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_alb_ins AFTER INSERT ON albums \n"\
+        "      BEGIN UPDATE groups SET name = NEW.album, album_artist = \n"\
+        "            (SELECT artist FROM artists WHERE id = NEW.album_artist)\n"\
+        "            WHERE type = 1 AND ref = NEW.id; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_alb_upd AFTER UPDATE ON albums \n"\
+        "      BEGIN UPDATE groups SET name = NEW.album, album_artist = \n"\
+        "            (SELECT artist FROM artists WHERE id = NEW.album_artist)\n"\
+        "            WHERE type = 1 AND ref = NEW.id; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_art_ins AFTER INSERT ON artists \n"\
+        "      BEGIN UPDATE groups SET name = NEW.artist \n"\
+        "            WHERE type = 2 AND ref = NEW.id; \n"\
+        "            UPDATE groups SET album_artist = NEW.artist \n"\
+        "            WHERE type = 1 AND ref IN \n"\
+        "            (SELECT id FROM albums WHERE album_artist = NEW.id); END;\n"\
+        "CREATE TRIGGER IF NOT EXISTS grp_art_upd AFTER UPDATE ON artists \n"\
+        "      BEGIN UPDATE groups SET name = NEW.artist \n"\
+        "            WHERE type = 2 AND ref = NEW.id; \n"\
+        "            UPDATE groups SET album_artist = NEW.artist \n"\
+        "            WHERE type = 1 AND ref IN \n"\
+        "            (SELECT id FROM albums WHERE album_artist = NEW.id); END;\n"\
+        "   DELETE FROM groups; \n"\
+        "   INSERT INTO groups \n"\
+        "          (type, ref, name, album_artist, items, persistentid) \n"\
+        "   SELECT 1, al.id, al.album, ar.artist, COUNT(*), (1 << 40) | al.id\n"\
+        "   FROM   songs s JOIN albums al ON s.album = al.id \n"\
+        "          LEFT JOIN artists ar ON ar.id = al.album_artist \n"\
+        "   GROUP  BY al.id; \n"\
+        "   INSERT INTO groups \n"\
+        "          (type, ref, name, items, persistentid) \n"\
+        "   SELECT 2, ar.id, ar.artist, COUNT(*), (2 << 40) | ar.id \n"\
+        "   FROM   songs s JOIN artists ar ON s.artist = ar.id \n"\
+        "   GROUP  BY ar.id;"
+    },
+// the revision each song was last written or deleted at, for delta item
+// listings.  revision.rev is kept by the writer at the revision its open
+// transaction will commit as, starting past the revision 1 clients ask
+// for first.  deleted songs are kept as tombstones so
+// they can be listed in mudl.  the songs of an artist or album whose sort
+// name changes are logged too, so the sort permutations re-key them.
+    { "changes",
+        "CREATE TABLE IF NOT EXISTS revision (\n"\
+        "    id            INTEGER PRIMARY KEY CHECK (id = 1),\n"\
+        "    rev           INTEGER NOT NULL\n"\
+        "); \n"\
+        "INSERT INTO revision (id, rev) SELECT 1, 2 \n"\
+        "   WHERE NOT EXISTS (SELECT 1 FROM revision); \n"\
+        "CREATE TABLE IF NOT EXISTS changes (\n"\
+        "    song          INTEGER PRIMARY KEY NOT NULL,\n"\
+        "    revision      INTEGER NOT NULL,\n"\
+        "    deleted       INTEGER DEFAULT 0\n"\
+        "); \n"\
+        "CREATE INDEX IF NOT EXISTS idx_changes_rev \n"\
+        "   ON changes(revision, deleted);\n"\
+        "CREATE TRIGGER IF NOT EXISTS chg_son_ins AFTER INSERT ON songs \n"\
+        "      BEGIN INSERT OR REPLACE INTO changes (song, revision, deleted)\n"\
+        "            SELECT NEW.id, rev, 0 FROM revision; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS chg_son_upd AFTER UPDATE ON songs \n"\
+        "      BEGIN INSERT OR REPLACE INTO changes (song, revision, deleted)\n"\
+        "            SELECT NEW.id, rev, 0 FROM revision; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS chg_son_del AFTER DELETE ON songs \n"\
+        "      BEGIN INSERT OR REPLACE INTO changes (song, revision, deleted)\n"\
+        "            SELECT OLD.id, rev, 1 FROM revision; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS chg_art_sort BEFORE INSERT ON artists \n"\
+        "      WHEN EXISTS (SELECT 1 FROM artists WHERE id = NEW.id \n"\
+        "                   AND artist_sort IS NOT NEW.artist_sort) \n"\
+        "      BEGIN INSERT OR REPLACE INTO changes (song, revision, deleted)\n"\
+        "            SELECT s.id, rev, 0 FROM songs s, revision \n"\
+        "            WHERE s.artist = NEW.id; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS chg_alb_sort BEFORE INSERT ON albums \n"\
+        "      WHEN EXISTS (SELECT 1 FROM albums WHERE id = NEW.id \n"\
+        "                   AND album_sort IS NOT NEW.album_sort) \n"\
+        "      BEGIN INSERT OR REPLACE INTO changes (song, revision, deleted)\n"\
+        "            SELECT s.id, rev, 0 FROM songs s, revision \n"\
+        "            WHERE s.album = NEW.id; END;"
+    },
+// where in its file each song's cover picture is, for the artwork 
+// requests to send straight from the file
+    { "artwork",
+        "CREATE TABLE IF NOT EXISTS artwork (\n"\
+        "    song          INTEGER PRIMARY KEY NOT NULL REFERENCES songs (id),\n"\
+        "    start         INTEGER NOT NULL,\n"\
+        "    length        INTEGER NOT NULL,\n"\
+        "    mime          VARCHAR(64) DEFAULT NULL\n"\
+        "); \n"\
+        "CREATE TRIGGER IF NOT EXISTS pic_son_del AFTER DELETE ON songs \n"\
+        "      BEGIN DELETE FROM artwork WHERE song = OLD.id; END;"
+    },
+// the songs each smart playlist's query matches, kept by the writer for
+// its items count.  rebuilt whenever the database is opened.
+    { "smartitems",
+        "CREATE TABLE IF NOT EXISTS smartitems (\n"\
+        "    playlistid    INTEGER NOT NULL REFERENCES playlists (id),\n"\
+        "    songid        INTEGER NOT NULL REFERENCES songs     (id),\n"\
+        "    PRIMARY KEY (playlistid, songid)\n"\
+        "); \n"\
+        "CREATE INDEX IF NOT EXISTS idx_smi_song ON smartitems(songid);\n"\
+        "CREATE TRIGGER IF NOT EXISTS smi_ins AFTER INSERT ON smartitems \n"\
+        "      BEGIN UPDATE playlists SET items = items + 1 \n"\
+        "            WHERE id = NEW.playlistid; END; \n"\
+        "CREATE TRIGGER IF NOT EXISTS smi_del AFTER DELETE ON smartitems \n"\
+        "      BEGIN UPDATE playlists SET items = items - 1 \n"\
+        "            WHERE id = OLD.playlistid; END; \n"\
+        "   DELETE FROM smartitems; \n"\
+        "   UPDATE playlists SET items = 0 WHERE type = 2;"
+    },
         NULL
 };
 
@@ -482,6 +782,10 @@ int db_open_database(app *aux, int flags) {
 }
 int db_close_database(app *aux) {
     int ret;
+    long hits, misses;
+    stmtcache_stats(aux->stmtcache, &hits, &misses);
+    LOGGER(LOG_INFO, "statement cache: %ld hits, %ld misses", hits, misses);
+    stmtcache_free(aux->stmtcache);
     for (q_type q = 0; q < Q_PRECOMPILED_MAX; q++) 
         sqlite3_finalize(aux->stmts[q]);
     ret = sqlite3_close_v2(aux->db);
@@ -494,6 +798,7 @@ int db_close_database(app *aux) {
 void precompile_statements(void *arg) {
     app *aux = (app *)arg;
     aux->stmts = calloc(Q_PRECOMPILED_MAX, sizeof(sqlite3_stmt *));
+    aux->stmtcache = stmtcache_new(aux->db, conf.stmtcache);
     int ret;
     q_type q;
     for (q = 0; q < Q_PRECOMPILED_MAX; q++) {
@@ -735,30 +1040,13 @@ size_t count_smart_items(app *aux, t_type table, vector *clauses, int *bindvar)
     }
     strcat(sqlstr, ";");
     // now the query string is built
-    LOGGER(LOG_INFO, "query: %s\n", sqlstr);
-    ret = sqlite3_prepare_v2(aux->db, sqlstr, -1, &stmt, NULL);
-    if (ret != SQLITE_OK) {
-        free(sqlstr);
-        sqlite3_finalize(stmt);
-        return 0;
-    }
-    if (bindvar) {
-        sqlite3_bind_int(stmt, 1, *bindvar);
-        if (ret != SQLITE_OK) {
-            free(sqlstr);
-            sqlite3_finalize(stmt);
-            return 0;
-        }
-    }
-    ret = sqlite3_step(stmt);
-    if (ret != SQLITE_ROW) {
-        free(sqlstr);
-        sqlite3_finalize(stmt);
-        return 0;
-    }
-    qty = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    stmt = sql_open_results(aux, sqlstr, bindvar);
     free(sqlstr);
+    if (!stmt) return 0;
+    ret = sqlite3_step(stmt);
+    if (ret == SQLITE_ROW)
+        qty = sqlite3_column_int(stmt, 0);
+    sql_close_results(aux, stmt);
     return qty;
     
 }
@@ -777,6 +1065,26 @@ size_t count_precompiled_items(app *aux, q_type q, int *bindvar) {
     return result;
 }
 
+/**
+ * @brief the ids of the songs deleted in revisions since + 1 to until
+ * @return an array of *n ids, to be freed by the caller
+ */
+int *sql_deleted_since(app *aux, int since, int until, int *n) {
+    sqlite3_stmt *stmt = aux->stmts[Q_DELETED_SINCE];
+    int cap = 64;
+    int *ids = malloc(cap * sizeof(int));
+    *n = 0;
+    sqlite3_bind_int(stmt, 1, since);
+    sqlite3_bind_int(stmt, 2, until);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (*n == cap)
+            ids = realloc(ids, (cap *= 2) * sizeof(int));
+        ids[(*n)++] = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    return ids;
+}
+
 void sql_delete_file(sqlite3 *db, const char *path) {
     sqlite3_stmt *stmt;
     int ret;
@@ -789,6 +1097,61 @@ void sql_delete_file(sqlite3 *db, const char *path) {
     sqlite3_finalize(stmt);
 }
 
+/**
+ * @brief combine the db columns of the meta tags with comma separation
+ * @return the column list, to be released with free()
+ */
+char *sql_column_list(vector *columns) {
+    meta_tag_t *tag;
+    char *buf;
+    if (columns && columns->used > 0) {
+        size_t len = 2;
+        for (int i = 0; i < columns->used; i++) {
+            tag = columns->data[i];
+            if (tag->db_column)
+                len += strlen(tag->db_column) + 1;
+        }
+        buf = malloc(len);
+        buf[0] = '\0';
+        for (int i = 0; i < columns->used; i++) {
+            tag = columns->data[i];
+            if (!tag->db_column) continue;
+            if (buf[0]) strcat(buf, ",");
+            strcat(buf, tag->db_column);
+        }
+        return buf;
+    } 
+ // if no columns specified, return all columns
+    return strdup("*");
+}
+
+/**
+ * @brief build a listing query from a column list made by sql_column_list()
+ */
+void sql_build_query_columns(query_t *q, const char *columns,
+                             vector *clauses, char **output) {
+    char *str;
+    size_t len = strlen(columns) + strlen(queries[q->type].query) + 2;
+    // make space for clauses
+    if (clauses) {
+        for (int i = 0; i < clauses->used; i++) {
+            str = clauses->data[i];
+            len += strlen(str) + 1;
+        }
+    }
+    char *out = malloc(len);
+    sprintf(out, queries[q->type].query, columns); 
+    if (clauses) {
+        for (int i = 0; i < clauses->used; i++) {
+            str = clauses->data[i];
+            strcat(out, " ");
+            strcat(out, str);
+        }
+    }
+    strcat(out, ";");
+    *output = out;
+}
+
 void sql_build_query(query_t *q, vector *columns, 
                      vector *clauses, char **output) {
     if (!q) return;
@@ -798,63 +1161,10 @@ void sql_build_query(query_t *q, vector *columns,
         case Q_ITEMLIST:        
         case Q_GROUPLIST:
         case Q_CONTAINERITEMS:
-        case Q_CONTAINERLIST:  {    
- // combine the columns with comma separation
-            meta_tag_t *tag;
-            if (columns && columns->used > 0) {
-                len = 2;
-                for (int i = 0; i < columns->used; i++) {
-                    tag = columns->data[i];
-                    if (tag->db_column)
-                        len += strlen(tag->db_column) + 1;
-                }
-                buf = malloc(len);
-                int opos = 0, ipos = 0, i = 0;
-                tag = columns->data[i];
-                char *src = tag->db_column;
-                while (i < columns->used && opos < len) {
-                    if (!src) {
-                        tag = columns->data[++i];
-                        src = tag->db_column;
-                        continue;
-                    }
-                    if (src[ipos] == '\0') {
-                        i++;
-                        if (i < columns->used) {
-                            tag = columns->data[i];
-                            buf[opos++] = ',';
-                        } else buf[opos++] = '\0';
-                        ipos = 0;
-                        src = tag->db_column;
-                    } else
-                        buf[opos++] = src[ipos++];
-                }
-            } else { 
- // if no columns specified, return all columns
-                buf = "*";
-                len = 1;
-            }
-            len += strlen(queries[q->type].query);
-            // make space for clauses
-            if (clauses) {
-                for (int i = 0; i < clauses->used; i++) {
-                    str = clauses->data[i];
-                    len += strlen(str) + 1;
-                }
-            }
-            char *out = malloc(len);
-            sprintf(out, queries[q->type].query, buf); 
-            if (clauses) {
-                for (int i = 0; i < clauses->used; i++) {
-                    str = clauses->data[i];
-                    strcat(out, " ");
-                    strcat(out, str);
-                }
-            }
-            strcat(out, ";");
-            *output = out;
+        case Q_CONTAINERLIST:
+            buf = sql_column_list(columns);
+            sql_build_query_columns(q, buf, clauses, output);
             free(buf);
-            }
             break;
         case Q_COUNT_SMART: 
             len = strlen(queries[q->type].query) + 2;
@@ -883,95 +1193,88 @@ void sql_build_query(query_t *q, vector *columns,
     LOGGER(LOG_INFO, "query: '%s'\n", *output);
 }
 
+/**
+ * @brief get a prepared statement for a dynamically built query from the
+ *        thread's statement cache, and bind its parameter, if any.
+ *        hand it back with sql_close_results().
+ * @return the statement, or NULL on error
+ */
+sqlite3_stmt *sql_open_results(app *aux, const char *sqlstr, int *bindvar) {
+    sqlite3_stmt *stmt = stmtcache_acquire(aux->stmtcache, sqlstr);
+    if (stmt && aux->filter)
+        filter_bind(aux->filter, stmt);
+    if (stmt && aux->range)
+        keyset_bind(aux->range, stmt);
+    if (stmt && aux->since > 0) {
+        sqlite3_bind_int(stmt, 
+            sqlite3_bind_parameter_index(stmt, ":since"), aux->since);
+        sqlite3_bind_int(stmt, 
+            sqlite3_bind_parameter_index(stmt, ":until"), aux->until);
+    }
+    if (stmt && bindvar) {
+        if (sqlite3_bind_int(stmt, 1, *bindvar) != SQLITE_OK) {
+            stmtcache_release(aux->stmtcache, stmt);
+            return NULL;
+        }
+    }
+    return stmt;
+}
+
+void sql_close_results(app *aux, sqlite3_stmt *stmt) {
+    stmtcache_release(aux->stmtcache, stmt);
+}
+
+/**
+ * @brief a sizing pass over a listing query without a callback: the exact
+ *        number of bytes sql_put_results() would encode.
+ */
+size_t sql_size_results(app *aux, plan_t *plan, 
+                        const char *sqlstr, int *bindvar, int *nitems) {
+    size_t size = 0;
+    int n = 0;
+    sqlite3_stmt *stmt = sql_open_results(aux, sqlstr, bindvar);
+    if (stmt) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            size += plan_row_size(plan, stmt);
+            n++;
+        }
+        sql_close_results(aux, stmt);
+    }
+    if (nitems) *nitems = n;
+    return size;
+}
+
+/**
+ * @brief encode every row of the query as an mlit listing item, straight
+ *        into dest.  item_cb may append to the item and decides whether
+ *        it is kept.
+ * @return the number of items kept, or -1 on error
+ */
 int sql_put_results(
-        struct evbuffer **dest, 
-        struct evbuffer **items,  
+        DMAPBUF *dest, 
         app *aux, 
-        vector *cols, 
-        int start_col, 
+        plan_t *plan, 
         const char *sqlstr, 
         int *bindvar, 
-        int(*item_cb)(app *aux, struct evbuffer *item, meta_info_t *info)
+        int(*item_cb)(app *aux, DMAPBUF *item, meta_info_t *info)
         ) {
-    sqlite3 *db = aux->db;
-    sqlite3_stmt *stmt; 
-    int ret, val, i = 0, nitems = 0, keep_item;
-    unsigned long long lval;
-    sqlite3_prepare_v2(db, sqlstr, -1, &stmt, NULL);
-    if (bindvar) {
-        ret = sqlite3_bind_int(stmt, 1, *bindvar);
-        if (ret != SQLITE_OK) {
-            sqlite3_finalize(stmt);
-            return -1;
-        }
-    }
-    const char *str;
+    int i = 0, nitems = 0, keep_item;
+    sqlite3_stmt *stmt = sql_open_results(aux, sqlstr, bindvar);
+    if (!stmt) return -1;
     meta_info_t info = {0};
-    char *base = (char *)(&info);
-    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
-        items[i] = evbuffer_new();
-        evbuffer_expand(items[i], 512);
-// loop through columns
-        for (int col = 0; col < cols->used; col++) { 
-            meta_tag_t *tag = cols->data[col];
-            if (!strcmp(tag->tag, "mcti")) { 
-// dmap.containeritemid - replace it with place in results
-                dmap_add_int(items[i], "mcti", i + 1);
-            } else switch(tag->type) {
-                case T_LONG:
-                        lval = sqlite3_column_int64(stmt, col);
-                        if (col >= start_col) 
-                            dmap_add_long(items[i], tag->tag, lval);
-                        if (item_cb) {
-                            long *loc = (long *)(base + tag->ofs);
-                            *loc = lval;
-                        } break;
-                case T_DATE:
-                case T_INT:
-                        val = sqlite3_column_int(stmt, col);
-                        if (col >= start_col) 
-                            dmap_add_int(items[i], tag->tag, val);
-                        if (item_cb) {
-                            int *loc = (int *)(base + tag->ofs);
-                            *loc = val;
-                        } break;
-                case T_CHAR:
-                        val = sqlite3_column_int(stmt, col);
-                        if (col >= start_col) 
-                            dmap_add_char(items[i], tag->tag, (char)val);
-                        if (item_cb) {
-                            char *loc = (char *)(base + tag->ofs);
-                            *loc = (char)val;
-                        } break;
-                case T_SHORT: 
-                        val = sqlite3_column_int(stmt, col);
-                        if (col >= start_col) 
-                            dmap_add_short(items[i], tag->tag, (short)val);
-                        if (item_cb) {
-                            short *loc = (short *)(base + tag->ofs);
-                            *loc = (short)val;
-                        } break;
-                case T_STRING:
-                        str = sqlite3_column_text(stmt, col);
-                        if (col >= start_col) 
-                            dmap_add_string(items[i], tag->tag, STR(str));
-                        if (item_cb) {
-                            char **loc = (char **)(base + tag->ofs);
-                            *loc = (char *)str;
-                        } break;
-                default:  break;
-            }
-        }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        size_t item = dmap_buf_open_list(dest, "mlit");
+        plan_put_row(plan, dest, stmt, i, item_cb ? &info : NULL);
         if (item_cb) 
-            keep_item = item_cb(aux, items[i], &info);
+            keep_item = item_cb(aux, dest, &info);
         else keep_item = 1;
         if (keep_item) {
-            dmap_add_list(*dest, "mlit", evbuffer_get_length(items[i]));
-            evbuffer_add_buffer(*dest, items[i]);
+            dmap_buf_close_list(dest, item);
             nitems++;
-        }
+        } else
+            dmap_buf_truncate(dest, item);
         i++;
     }
-    sqlite3_finalize(stmt);
+    sql_close_results(aux, stmt);
     return nitems;
 }
@@ -6,11 +6,15 @@
 #include "sqlite3ext.h"
 #include "config.h"
 #include "meta.h"
+#include "dmap.h"
+#include "plan.h"
 #include "vector.h"
 #include "scratch.h"
 #include "util.h"
 
 #define STR(x) (x ? x : "")
+// follows any other clauses of a Q_GROUPLIST
+#define GROUPLIST_ORDER "ORDER BY COALESCE(g.name, ''), g.id"
 #define EMPTY_STRLIST { 0 }
 
 int sqlite3_closure_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *aApi);
@@ -28,8 +32,11 @@ typedef enum t_type {
     T_PLAYLISTITEMS,
     T_TEMP,
     T_PLAYS,
-    T_MAX,
     T_GROUPS,
+    T_CHANGES,
+    T_ARTWORK,
+    T_SMARTITEMS,
+    T_MAX,
     T_INOTIFY,
     T_PAIRINGS,
     T_SPEAKERS,
@@ -46,6 +53,7 @@ typedef enum q_type {
     Q_COUNT_PL_ITEMS,
     Q_COUNT_ALBUM_ITEMS,
     Q_COUNT_ARTIST_ITEMS,
+    Q_SMART_PLAYLISTS,
     Q_SMARTPL_QUERY,
     Q_ALBUM_ARTIST,
     Q_REMOVE_PATH,
@@ -70,6 +78,23 @@ typedef enum q_type {
     Q_FIND_GENRE,
     Q_FIND_ALBUM,
     Q_FIND_SONG,
+    Q_BROWSE_ARTISTS,
+    Q_BROWSE_ALBUMS,
+    Q_BROWSE_GENRES,
+    Q_BROWSE_COMPOSERS,
+    Q_FILTER_INDEX,
+    Q_SORT_KEYS,
+    Q_SORT_CHANGES,
+    Q_GET_REVISION,
+    Q_SET_REVISION,
+    Q_DELETED_SINCE,
+    Q_SET_ARTWORK,
+    Q_REMOVE_ARTWORK,
+    Q_ITEM_ARTWORK,
+    Q_GROUP_ARTWORK,
+    Q_STREAM_INFO,
+    Q_NEXT_TRACKS,
+    Q_SMART_UNCOUNT,
     Q_BEGIN_TRANSACTION,
     Q_END_TRANSACTION,
     Q_PRECOMPILED_MAX,
@@ -79,6 +104,7 @@ typedef enum q_type {
     Q_CONTAINERITEMS,
     Q_GROUPLIST,
     Q_COUNT_SMART,
+    Q_SMART_ITEMS,
     Q_MAX             
 } q_type;
 
@@ -156,24 +182,30 @@ int db_find_path_with_parent(app *aux, const char *path, const int parent, SCRAT
 size_t count_precompiled_items (app *aux, q_type q, int *bindvar);
 size_t count_smart_items       (app *aux, t_type table, 
                                 vector *clauses, int *bindvar); 
+int   *sql_deleted_since       (app *aux, int since, int until, int *n);
 
 const char *get_smart_playlist_query (app *aux, int playlist); 
 const char *get_albumgroup_artist    (app *aux, int id); 
 
-int sql_put_results(struct evbuffer **dest, 
-                    struct evbuffer **items, 
+sqlite3_stmt *sql_open_results(app *aux, const char *sqlstr, int *bindvar);
+void   sql_close_results(app *aux, sqlite3_stmt *stmt);
+size_t sql_size_results(app *aux, plan_t *plan, 
+                        const char *sqlstr, int *bindvar, int *nitems);
+int sql_put_results(DMAPBUF *dest, 
                     app *aux, 
-                    vector *cols, 
-                    int start_col, 
+                    plan_t *plan, 
                     const char *sqlstr, 
                     int *bindvar, 
                     int(*item_cb)(app *aux, 
-                                  struct evbuffer *item, 
+                                  DMAPBUF *item, 
                                   meta_info_t *info
                                   )
                     );
 void sql_build_query(query_t *q, vector *columns, 
                      vector *clauses, char **output);
+char *sql_column_list(vector *columns);
+void sql_build_query_columns(query_t *q, const char *columns,
+                             vector *clauses, char **output);
 
 void sql_delete_file(sqlite3 *db, const char *path);
 #endif
@@ -0,0 +1,149 @@
+// A per connection cache of prepared statements for dynamically built SQL:
+// meta profile SELECTs, smart playlist queries and counts.  Owned by a 
+// single thread, so there is no locking.  Statements are removed from the 
+// cache while checked out, so a listing that keeps its cursor open across 
+// event loop iterations never shares it; a second request for the same 
+// text prepares another copy, and the spare is finalized on release.
+// The schema is only created at startup, before any thread prepares a
+// statement, and sqlite3_prepare_v2() statements re-prepare themselves
+// should it ever change, so nothing is flushed for it.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include "system.h"
+#include "stmtcache.h"
+
+#define BUCKETS_PER_ENTRY 2
+
+typedef struct sc_entry {
+    sqlite3_stmt    *stmt;
+    const char      *sql;    // owned by stmt
+    unsigned long    hash;
+    struct sc_entry *prev, *next;   // LRU order, most recent first
+    struct sc_entry *hnext;
+} sc_entry;
+
+struct _stmtcache {
+    sqlite3    *db;
+    sc_entry  **buckets;
+    long        nbuckets;
+    long        capacity;
+    long        used;
+    sc_entry   *head, *tail;
+    long        hits, misses;
+};
+
+static unsigned long _hash(const char *key) {
+    unsigned long h = 5381;
+    int c;
+    while ((c = *key++))
+        h = ((h << 5) + h) + c;
+    return h;
+}
+
+static void _unlink(STMTCACHE *c, sc_entry *e) {
+    sc_entry **p;
+    for (p = &c->buckets[e->hash % c->nbuckets]; *p != e; p = &(*p)->hnext)
+        ;
+    *p = e->hnext;
+    if (e->prev) e->prev->next = e->next;
+    else c->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    c->used--;
+}
+
+static void _flush(STMTCACHE *c) {
+    while (c->head) {
+        sc_entry *e = c->head;
+        _unlink(c, e);
+        sqlite3_finalize(e->stmt);
+        free(e);
+    }
+}
+
+STMTCACHE *stmtcache_new(sqlite3 *db, long capacity) {
+    STMTCACHE *c = calloc(1, sizeof(STMTCACHE));
+    c->db         = db;
+    c->capacity   = capacity > 0 ? capacity : 0;
+    c->nbuckets   = c->capacity * BUCKETS_PER_ENTRY + 1;
+    c->buckets    = calloc(c->nbuckets, sizeof(sc_entry *));
+    return c;
+}
+
+void stmtcache_free(STMTCACHE *c) {
+    if (!c) return;
+    _flush(c);
+    free(c->buckets);
+    free(c);
+}
+
+/**
+ * @brief a prepared statement for sql, reset and with no bindings.
+ *        it must be handed back with stmtcache_release().
+ * @return the statement, or NULL if sql doesn't compile
+ */
+sqlite3_stmt *stmtcache_acquire(STMTCACHE *c, const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    unsigned long hash = _hash(sql);
+    for (sc_entry *e = c->buckets[hash % c->nbuckets]; e; e = e->hnext)
+        if (e->hash == hash && !strcmp(e->sql, sql)) {
+            stmt = e->stmt;
+            _unlink(c, e);
+            free(e);
+            c->hits++;
+            sqlite3_clear_bindings(stmt);
+            return stmt;
+        }
+    c->misses++;
+    int ret = sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL);
+    if (ret != SQLITE_OK) {
+        LOGGER(LOG_ERR, "failed to prepare query (%d): %s", ret, sql);
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+/**
+ * @brief reset a statement from stmtcache_acquire() and keep it for reuse
+ */
+void stmtcache_release(STMTCACHE *c, sqlite3_stmt *stmt) {
+    if (!stmt) return;
+    sqlite3_reset(stmt);
+    const char *sql = sqlite3_sql(stmt);
+    unsigned long hash = _hash(sql);
+    sc_entry **slot = &c->buckets[hash % c->nbuckets];
+    int keep = c->capacity > 0;
+    for (sc_entry *e = *slot; e && keep; e = e->hnext)
+        if (e->hash == hash && !strcmp(e->sql, sql))
+            keep = 0;  // a copy is already cached
+    if (!keep) {
+        sqlite3_finalize(stmt);
+        return;
+    }
+    if (c->used >= c->capacity) {
+        sc_entry *lru = c->tail;
+        _unlink(c, lru);
+        sqlite3_finalize(lru->stmt);
+        free(lru);
+    }
+    sc_entry *e = malloc(sizeof(sc_entry));
+    e->stmt  = stmt;
+    e->sql   = sql;
+    e->hash  = hash;
+    e->hnext = *slot;
+    *slot    = e;
+    e->prev  = NULL;
+    e->next  = c->head;
+    if (c->head) c->head->prev = e;
+    else c->tail = e;
+    c->head  = e;
+    c->used++;
+}
+
+void stmtcache_stats(STMTCACHE *c, long *hits, long *misses) {
+    *hits   = c ? c->hits   : 0;
+    *misses = c ? c->misses : 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __STMTCACHE_H__
+#define __STMTCACHE_H__
+#include <sqlite3.h>
+
+// a per connection LRU of prepared statements, keyed by their SQL text, 
+// for queries built at run time.  a statement is checked out by acquire
+// and returned, reset, by release.
+
+typedef struct _stmtcache STMTCACHE;
+
+STMTCACHE    *stmtcache_new           (sqlite3 *db, long capacity);
+void          stmtcache_free          (STMTCACHE *c);
+sqlite3_stmt *stmtcache_acquire       (STMTCACHE *c, const char *sql);
+void          stmtcache_release       (STMTCACHE *c, sqlite3_stmt *stmt);
+void          stmtcache_stats         (STMTCACHE *c, long *hits, long *misses);
+#endif
@@ -7,7 +7,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <event2/event.h>
+#include <event2/bufferevent.h>
 #include <evhtp/evhtp.h>
 #include <sqlite3.h>
 #include "system.h"
@@ -23,6 +29,9 @@
 #include "scratch.h"
 #include "cache.h"
 #include "stream.h"
+#include "reader.h"
+#include "prefetch.h"
+#include "bandwidth.h"
 
 //#define CHUNK_DELAY  250
 //#define CHUNK_SIZE   1024*1024
@@ -62,9 +71,12 @@ void *create_segment(int id, void *a) {
         LOGGER(LOG_ERR, "error stat() file %d", fd);
         goto error;
     }
+// songs are read front to back: let the kernel read further ahead
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     if (st.st_size > 0) {
         cn = malloc(sizeof(CACHENODE));
         cn->size = st.st_size;
+        cn->fd   = fd;
         cn->file_segment = evbuffer_file_segment_new(
                 fd, 0, st.st_size, 
                 EVBUF_FS_CLOSE_ON_FREE
@@ -78,63 +90,417 @@ error:
     return cn;
 }
 
+// the IPv4 networks whose clients are sent whole files in one reply with
+// a Content-Length, so that libevent can sendfile() them and the socket 
+// buffer paces them, rather than in chunks on a timer.  "*" is everyone.
+typedef struct network_t {
+    uint32_t addr, mask;  // network byte order
+} network_t;
+
+static network_t *sendfile_nets  = NULL;
+static int        nsendfile_nets = 0;
+static int        sendfile_all   = 0;
+
+/**
+ * @brief set the clients sent whole files from a list of networks such as
+ *        "192.168.0.0/16, 10.0.0.0/8", or "*" for every client.
+ */
+void stream_set_sendfile_networks(const char *list) {
+    char *copy = strdup(list ? list : ""), *save = NULL, *net;
+    for (net = strtok_r(copy, ", ", &save); net; 
+         net = strtok_r(NULL, ", ", &save)) {
+        struct in_addr in;
+        int bits = 32;
+        char *slash = strchr(net, '/');
+        if (!strcmp(net, "*")) {
+            sendfile_all = 1;
+            continue;
+        }
+        if (slash) {
+            *slash = '\0';
+            bits = atoi(slash + 1);
+        }
+        if (bits < 0 || bits > 32 || inet_pton(AF_INET, net, &in) != 1) {
+            LOGGER(LOG_ERR, "ignoring bad sendfile network '%s'", net);
+            continue;
+        }
+        sendfile_nets = realloc(sendfile_nets, 
+                                (nsendfile_nets + 1) * sizeof(network_t));
+        network_t *n = &sendfile_nets[nsendfile_nets++];
+        n->mask = bits ? htonl(~0U << (32 - bits)) : 0;
+        n->addr = in.s_addr & n->mask;
+    }
+    free(copy);
+    if (sendfile_all || nsendfile_nets)
+        LOGGER(LOG_INFO, "sending whole files to %s", 
+                         sendfile_all ? "all clients" : list);
+}
+
+static int sendfile_client(evhtp_connection_t *conn) {
+    if (sendfile_all) return 1;
+    if (!conn->saddr || conn->saddr->sa_family != AF_INET) return 0;
+    uint32_t addr = ((struct sockaddr_in *)conn->saddr)->sin_addr.s_addr;
+    for (int i = 0; i < nsendfile_nets; i++)
+        if ((addr & sendfile_nets[i].mask) == sendfile_nets[i].addr)
+            return 1;
+    return 0;
+}
+
+// a paced stream keeps the client conf.streamlead seconds of audio ahead
+// of where it would be playing had it started when the stream did.  it is
+// driven by the connection's output buffer: the next chunk is sent once
+// what is pending there drains below the low watermark, so a stalled
+// socket costs nothing until it moves again.  the timer only holds a
+// chunk back while the client already has more than the lead.
+#define DEFAULT_RATE   40000      // 320 kbps, when a song's is unknown
+#define LOW_WATERMARK  (conf.chunksize / 2)
+#define MIN_DELAY_US   1000
+
 typedef struct stream_t {
     int id;
     size_t size;
     size_t offset;
     size_t current;
     void *data;
+    int fd;
+    app *aux;               // set if chunks are read by reader.c
+    READ *reading;          // the chunk being read
+    BWFLOW *flow;           // set if streams are capped
+    int waiting;            // for the flow's turn
+    int granted;            // the flow's turn came
     evbuf_t *buf;
     evhtp_request_t *req;
     evhtp_connection_t *conn;
     struct event *timer;
+    struct evbuffer_cb_entry *drained;
+    int armed;              // the timer is pending or active
+    size_t start;           // the first byte sent
+    size_t rate;            // bytes per second of audio
+    uint64_t started;       // usecs, monotonic
+    uint64_t checked;       // when delivered was last measured
+    size_t delivered;       // bytes the socket has taken
+    double drain;           // bytes per second the socket takes
+    int lowlead;            // chunks sent with less than half the lead
+    int underruns;          // chunks sent after the client ran dry
+    struct streams_t *reg;  // NULL once unlinked
+    struct stream_t *prev, *next;
 } stream_t;
 
-static void schedule_next_chunk(stream_t *st, int ms) {
+// the chunked streams each evhtp thread is sending.  a stream is freed by
+// the request_fini hook as soon as evhtp lets go of its request, whether
+// the client went away, its connection failed, or another request took
+// its place.  the lists are only changed by their own thread; the mutex
+// lets stream_log_stats() walk them from another.
+typedef struct streams_t {
+    pthread_mutex_t   mutex;
+    int               thread_id;
+    stream_t         *head;
+    int               active;
+    long              started;
+    long              finished;
+    long              dropped;      // closed before the last chunk was sent
+} streams_t;
+
+static streams_t      **threads  = NULL;
+static int              nthreads = 0;
+static pthread_mutex_t  streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void stream_link(streams_t *reg, stream_t *st) {
+    pthread_mutex_lock(&reg->mutex);
+    st->reg  = reg;
+    st->prev = NULL;
+    st->next = reg->head;
+    if (reg->head)
+        reg->head->prev = st;
+    reg->head = st;
+    reg->active++;
+    reg->started++;
+    pthread_mutex_unlock(&reg->mutex);
+}
+
+static void stream_unlink(stream_t *st) {
+    streams_t *reg = st->reg;
+    if (!reg) return;
+    pthread_mutex_lock(&reg->mutex);
+    if (st->prev)
+        st->prev->next = st->next;
+    else
+        reg->head = st->next;
+    if (st->next)
+        st->next->prev = st->prev;
+    reg->active--;
+    if (st->offset >= st->size)
+        reg->finished++;
+    else
+        reg->dropped++;
+    pthread_mutex_unlock(&reg->mutex);
+    st->reg = NULL;
+}
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the bytes per second a song plays at: from its bitrate, else its size
+// and length, else a guess that errs on the side of sending too fast
+static size_t stream_rate(app *aux, int id, size_t size) {
+    sqlite3_stmt *stmt = aux->stmts[Q_STREAM_INFO];
+    size_t rate = 0;
+    sqlite3_bind_int(stmt, 1, id);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        int bitrate = sqlite3_column_int(stmt, 0);   // kbps
+        int length  = sqlite3_column_int(stmt, 1);   // msecs
+        if (bitrate > 0)
+            rate = (size_t)bitrate * 125;
+        else if (length > 0)
+            rate = (size_t)((uint64_t)size * 1000 / length);
+    }
+    sqlite3_reset(stmt);
+    return rate ? rate : DEFAULT_RATE;
+}
+
+static void schedule_next_chunk(stream_t *st, uint64_t us) {
     struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = ms;
+    tv.tv_sec  = us / 1000000;
+    tv.tv_usec = us % 1000000;
+    st->armed  = 1;
     evtimer_add(st->timer, &tv);
 }
 
+/**
+ * @brief measure what the socket has taken since the last chunk, and how
+ *        fast.
+ * @return the bytes still waiting in the connection's output buffer
+ */
+static size_t stream_measure(stream_t *st, uint64_t now) {
+    size_t pending = evbuffer_get_length(bufferevent_get_output(st->conn->bev));
+    size_t queued  = st->offset - st->start;
+    size_t delivered = queued > pending ? queued - pending : 0;
+    if (now > st->checked && delivered > st->delivered) {
+        double rate = (delivered - st->delivered) * 1e6 / (now - st->checked);
+        st->drain = st->drain > 0 ? 0.75 * st->drain + 0.25 * rate : rate;
+    }
+    st->delivered = delivered;
+    st->checked   = now;
+    return pending;
+}
+
+// called on every change to the connection's output buffer.  the chunk
+// callback is run from the event loop rather than from here, as here is
+// inside whatever is adding to or draining the buffer.
+static void stream_drained_cb(struct evbuffer *out,
+                              const struct evbuffer_cb_info *info, void *arg) {
+    stream_t *st = (stream_t *)arg;
+    if (st->armed || info->n_deleted == 0)
+        return;
+    if (evbuffer_get_length(out) < LOW_WATERMARK) {
+        st->armed = 1;
+        event_active(st->timer, EV_TIMEOUT, 1);
+    }
+}
+
+static void stream_free(stream_t *st) {
+    stream_unlink(st);
+    if (st->reading)
+        reader_cancel(st->reading);
+    if (st->flow)
+        bw_close(st->flow);
+    if (st->drained && st->conn->bev)
+        evbuffer_remove_cb_entry(bufferevent_get_output(st->conn->bev),
+                                 st->drained);
+    if (st->timer)
+        event_free(st->timer);
+    if (st->buf) {
+        evbuffer_drain(st->buf, -1);
+        evbuffer_free(st->buf);
+    }
+    free(st);
+}
+
+// evhtp is done with the request: the last chunk has gone, or the
+// connection has
+static evhtp_res stream_fini_cb(evhtp_request_t *req, void *arg) {
+    stream_t *st = (stream_t *)arg;
+    if (st->offset < st->size)
+        LOGGER(LOG_INFO, "    file %d closed at chunk %lu", st->id, st->current);
+    stream_free(st);
+    return EVHTP_RES_OK;
+}
+
+// free the stream now, rather than when evhtp frees its request
+static void stream_close(stream_t *st) {
+    evhtp_unset_hook(&st->req->hooks, evhtp_hook_on_request_fini);
+    stream_free(st);
+}
+
+// the capped chunk waiting may be sent
+static void stream_ready_cb(void *arg) {
+    stream_t *st = (stream_t *)arg;
+    st->waiting = 0;
+    st->granted = 1;
+    st->armed   = 1;
+    event_active(st->timer, EV_TIMEOUT, 1);
+}
+
+// a chunk has been read: send it
+static int stream_read_cb(READ *r, unsigned char *buf, ssize_t len, 
+                          void *arg) {
+    stream_t *st = (stream_t *)arg;
+    st->reading = NULL;
+    if (st->conn->request != st->req) {
+        stream_close(st);
+        return 0;
+    }
+    if (len <= 0) {
+        LOGGER(LOG_ERR, "    file %d unreadable at %lu", st->id, st->offset);
+        evhtp_request_t *req = st->req;
+        stream_close(st);
+        evhtp_send_reply_chunk_end(req);
+        return 0;
+    }
+    reader_add_buffer(st->buf, buf, len);
+    st->offset += len;
+    evhtp_send_reply_chunk(st->req, st->buf);
+    return 1;
+}
+
 // send the next chunk
 static void stream_item_chunk_cb(evutil_socket_t fd, short events, void *arg) {
     stream_t *st = (stream_t *)arg;
+    st->armed = 0;
+    if (st->reading || st->waiting) 
+        return;
     if (st->conn->request == st->req) {
         if (st->offset >= st->size) {
             // no more chunks - clean up
-		    //LOGGER(LOG_INFO, "    file %d finished sending chunks", st->id);
-            evhtp_send_reply_chunk_end(st->req);
-            event_free(st->timer);
-            if (st->buf) {
-                evbuffer_drain(st->buf, -1);
-                evbuffer_free(st->buf);
-            }
-            free(st);
-        } else {
-		//LOGGER(LOG_INFO, "    file %d sending chunk %lu", st->id, st->current);
-            size_t size = st->size - st->offset;
-            st->current++;
-            if (size > conf.chunksize)
-                size = conf.chunksize;
-            evbuffer_add_file_segment(st->buf, st->data, st->offset, size);
-            st->offset += size;
-            evhtp_send_reply_chunk(st->req, st->buf);
-            schedule_next_chunk(st, conf.chunkdelay);
+            uint64_t secs = (now_us() - st->started) / 1000000;
+            LOGGER(LOG_INFO, "    file %d sent %lu chunks in %lus, "
+                             "%.0f B/s drained, %d low lead, %d underruns", 
+                             st->id, st->current, (unsigned long)secs, 
+                             st->drain, st->lowlead, st->underruns);
+            evhtp_request_t *req = st->req;
+            stream_close(st);
+            evhtp_send_reply_chunk_end(req);
+            return;
+        }
+        uint64_t now = now_us();
+        double elapsed = (now - st->started) / 1e6;
+// still backed up: stream_drained_cb will bring us back
+        if (stream_measure(st, now) >= LOW_WATERMARK)
+            return;
+// the audio queued past the lead, and the audio the client holds
+        double ahead = (double)(st->offset - st->start) / st->rate 
+                     - elapsed - conf.streamlead;
+        double lead  = (double)st->delivered / st->rate - elapsed;
+        if (ahead * 1e6 >= MIN_DELAY_US) {
+            schedule_next_chunk(st, ahead * 1e6);
+            return;
         }
+        size_t size = st->size - st->offset;
+        if (size > conf.chunksize)
+            size = conf.chunksize;
+// a capped chunk granted after waiting has been paid for already
+        if (st->flow && !st->granted &&
+            !bw_request(st->flow, size, lead < conf.streamlead / 2.0)) {
+            st->waiting = 1;
+            return;
+        }
+        st->granted = 0;
+        st->current++;
+        if (lead <= 0)
+            st->underruns++;
+        else if (lead < conf.streamlead / 2.0)
+            st->lowlead++;
+        if (st->aux) {
+            st->reading = reader_submit(st->aux, st->fd, st->offset, size,
+                                        stream_read_cb, st);
+            if (st->reading)
+                return;
+        }
+// start reading the chunks after this one while it is sent
+        posix_fadvise(st->fd, st->offset + size, 2 * conf.chunksize, 
+                      POSIX_FADV_WILLNEED);
+        evbuffer_add_file_segment(st->buf, st->data, st->offset, size);
+        st->offset += size;
+        evhtp_send_reply_chunk(st->req, st->buf);
     } else {
         // another request supercedes this one, stop sending chunks and clean up
         LOGGER(LOG_INFO, "    file %d interrupted at chunk %lu", st->id, st->current);
-        if (st->buf) {
-            while (evbuffer_get_length(st->buf))
-                evbuffer_drain(st->buf, -1);
-            evbuffer_free(st->buf);
-        }
-        free(st);
+        stream_close(st);
     }
     //close(fd);
     //return EVHTP_RES_OK;
 }
+/**
+ * @brief log, for every evhtp thread, the streams it is sending: how far
+ *        each has got, the bytes still in its connection's output buffer,
+ *        and the rate the client has taken them at.
+ */
+void stream_log_stats() {
+    uint64_t now = now_us();
+    int active = 0;
+    size_t inflight = 0;
+    pthread_mutex_lock(&streams_mutex);
+    for (int i = 0; i < nthreads; i++) {
+        streams_t *reg = threads[i];
+        size_t pending = 0;
+        pthread_mutex_lock(&reg->mutex);
+        for (stream_t *st = reg->head; st; st = st->next) {
+            size_t queued = st->offset - st->start;
+            size_t waiting = queued > st->delivered ? queued - st->delivered : 0;
+            double secs = (now - st->started) / 1e6;
+            LOGGER(LOG_INFO, "    thread %d file %d: %lu of %lu bytes, "
+                             "%lu in flight, %.0f B/s over %.0fs, %.0f B/s now",
+                             reg->thread_id, st->id, st->offset - st->start,
+                             st->size - st->start, waiting,
+                             secs > 0 ? st->delivered / secs : 0, secs, 
+                             st->drain);
+            pending += waiting;
+        }
+        LOGGER(LOG_INFO, "thread %d: %d streams, %lu bytes in flight, "
+                         "%ld started, %ld finished, %ld dropped",
+                         reg->thread_id, reg->active, pending, 
+                         reg->started, reg->finished, reg->dropped);
+        active   += reg->active;
+        inflight += pending;
+        pthread_mutex_unlock(&reg->mutex);
+    }
+    LOGGER(LOG_INFO, "%d streams on %d threads, %lu bytes in flight",
+                     active, nthreads, inflight);
+    pthread_mutex_unlock(&streams_mutex);
+}
+
+void stream_init_thread(app *aux) {
+    streams_t *reg = calloc(1, sizeof(streams_t));
+    pthread_mutex_init(&reg->mutex, NULL);
+    reg->thread_id = aux->thread_id;
+    aux->streams   = reg;
+    pthread_mutex_lock(&streams_mutex);
+    threads = realloc(threads, (nthreads + 1) * sizeof(streams_t *));
+    threads[nthreads++] = reg;
+    pthread_mutex_unlock(&streams_mutex);
+}
+
+void stream_term_thread(app *aux) {
+    streams_t *reg = aux->streams;
+    if (!reg) return;
+    pthread_mutex_lock(&streams_mutex);
+    for (int i = 0; i < nthreads; i++)
+        if (threads[i] == reg) {
+            threads[i] = threads[--nthreads];
+            break;
+        }
+    pthread_mutex_unlock(&streams_mutex);
+// whatever is still streaming is freed by its request_fini hook
+    while (reg->head)
+        stream_unlink(reg->head);
+    pthread_mutex_destroy(&reg->mutex);
+    free(reg);
+    aux->streams = NULL;
+}
+
 void add_stream_headers_out(evhtp_request_t *req) {
     
     evhtp_headers_add_header(req->headers_out,
@@ -150,6 +516,43 @@ void add_stream_headers_out(evhtp_request_t *req) {
 
 }
 
+/**
+ * @brief resolve a Range header of the form bytes=a-b, bytes=a- or 
+ *        bytes=-n against a file of size bytes.  a header that isn't a 
+ *        single range of bytes is ignored, as RFC 7233 allows.
+ * @return 1 with the range in *first and *last, 0 to send the whole file,
+ *         or -1 if the range is past the end of the file
+ */
+static int parse_range(const char *range, size_t size, 
+                       size_t *first, size_t *last) {
+    unsigned long long a, b;
+    char *end;
+    if (!range || strncmp(range, "bytes=", 6) || strchr(range, ','))
+        return 0;
+    const char *p = range + 6;
+    if (*p == '-') {
+// the last n bytes
+        b = strtoull(p + 1, &end, 10);
+        if (end == p + 1 || *end) return 0;
+        if (b == 0 || size == 0) return -1;
+        *first = b >= size ? 0 : size - b;
+        *last  = size - 1;
+        return 1;
+    }
+    a = strtoull(p, &end, 10);
+    if (end == p || *end != '-') return 0;
+    p = end + 1;
+    b = size - 1;
+    if (*p) {
+        b = strtoull(p, &end, 10);
+        if (*end || b < a) return 0;
+    }
+    if (a >= size) return -1;
+    *first = a;
+    *last  = b >= size ? size - 1 : b;
+    return 1;
+}
+
 void res_stream_item(evhtp_request_t *req, void *a) {
     log_request(req, a);
     add_stream_headers_out(req);
@@ -171,45 +574,196 @@ void res_stream_item(evhtp_request_t *req, void *a) {
     CACHENODE *song = cache_set_and_get(file_cache, id, aux);
     
     if (song) { 
+        size_t first = 0, last = song->size - 1;
+        char content_range[80];
+        int ranged = parse_range(evhtp_kv_find(req->headers_in, "Range"),
+                                 song->size, &first, &last);
+        if (ranged < 0) {
+            snprintf(content_range, sizeof(content_range), "bytes */%zu",
+                     song->size);
+            evhtp_headers_add_header(req->headers_out,
+                  evhtp_header_new("Content-Range", content_range, 0, 1));
+            evhtp_send_reply(req, EVHTP_RES_RANGENOTSC);
+            return;
+        }
+        int code = EVHTP_RES_OK;
+        if (ranged) {
+            LOGGER(LOG_INFO, "    file %d range %zu-%zu", id, first, last);
+            snprintf(content_range, sizeof(content_range), "bytes %zu-%zu/%zu",
+                     first, last, song->size);
+            evhtp_headers_add_header(req->headers_out,
+                  evhtp_header_new("Content-Range", content_range, 0, 1));
+            code = EVHTP_RES_PARTIAL;
+        }
         stream_t *st = malloc(sizeof(stream_t));
         st->req    = req;
-        st->size   = song->size;
+        st->size   = last + 1;  // the end of the range sent
         st->id     = id;
         st->data   = song->file_segment;
-        st->offset = 0;
+        st->fd     = song->fd;
+        st->aux    = aux->reader ? aux : NULL;
+        st->reading = NULL;
+        st->flow    = NULL;
+        st->waiting = 0;
+        st->granted = 0;
+        st->offset = first;
         st->current = 0;
         st->conn    = conn;
         st->buf = evbuffer_new();
         evbuffer_set_flags(st->buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+        st->timer     = NULL;
+        st->drained   = NULL;
+        st->armed     = 0;
+        st->reg       = NULL;
+        st->start     = first;
+        st->rate      = stream_rate(aux, id, song->size);
+        st->started   = now_us();
+        st->checked   = st->started;
+        st->delivered = 0;
+        st->drain     = 0;
+        st->lowlead   = 0;
+        st->underruns = 0;
         int entire = 0;
-        if (conf.chunksize <= 0) {
+// the whole range in one reply: evhtp sets its Content-Length
+        if (conf.chunksize <= 0 || sendfile_client(conn)) {
 		LOGGER(LOG_INFO, "    thread %d sending entire file", st->id);
             entire = 1;
-            evbuffer_add_file_segment(req->buffer_out, st->data, st->offset, st->size);
-            st->offset += st->size;
+            evbuffer_add_file_segment(req->buffer_out, st->data, st->offset, 
+                                      st->size - st->offset);
+            st->offset = st->size;
         }  
-        else if (conf.chunkpreload > 0) {
-            size_t size = conf.chunkpreload;
-            if (st->size <= size) {
+// the burst would be read on the loop, so with readers there is none
+        else if (!st->aux && (conf.chunkpreload > 0 || conf.streamburst > 0)) {
+// the initial burst, in seconds of audio if it is set
+            size_t size = conf.streamburst > 0 
+                        ? conf.streamburst * st->rate : conf.chunkpreload;
+            if (st->size - st->offset <= size) {
                 entire = 1;
-                size = st->size;
+                size = st->size - st->offset;
             }
             evbuffer_add_file_segment(req->buffer_out, st->data, st->offset, size);
             st->offset += size;
         }
         if (entire) {
             req->flags |= EVHTP_REQ_FLAG_KEEPALIVE;
-            evhtp_send_reply(req, EVHTP_RES_OK);
+            evhtp_send_reply(req, code);
+            stream_free(st);
         } else {    
             req->flags |= EVHTP_REQ_FLAG_CHUNKED | EVHTP_REQ_FLAG_KEEPALIVE;
             st->timer  = evtimer_new(aux->base, stream_item_chunk_cb, st);
-            evhtp_send_reply_chunk_start(req, EVHTP_RES_OK);
+            evhtp_send_reply_chunk_start(req, code);
+            st->drained = evbuffer_add_cb(bufferevent_get_output(conn->bev),
+                                          stream_drained_cb, st);
+            evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini,
+                           evhtp_hook_cast(stream_fini_cb), st);
+            st->flow = bw_open(aux, conn->saddr, st->rate, stream_ready_cb, st);
+            if (aux->streams)
+                stream_link(aux->streams, st);
             schedule_next_chunk(st, 0);
         }
-        db_inc_playcount(id);
+// a range past the start is a seek or a resume, not another play
+        if (first == 0) {
+            db_inc_playcount(id);
+            prefetch_submit(id);
+        }
     } else {
         LOGGER(LOG_INFO, "got a NULL song from cache");
         evhtp_send_reply(req, EVHTP_RES_NOTFOUND);
     }
     // cleanup now done in callback
 }
+
+/**
+ * @brief send the client to the stream listener for the same song: the
+ *        host it asked for, at conf.streamport, with the same path and query.
+ */
+void res_stream_redirect(evhtp_request_t *req, void *a) {
+    log_request(req, a);
+    evhtp_connection_t *conn = evhtp_request_get_connection(req);
+    const char *host = evhtp_kv_find(req->headers_in, "Host");
+    char hostname[256], location[1024];
+    if (host) {
+        size_t len = strcspn(host, host[0] == '[' ? "]" : ":");
+        if (host[0] == '[' && host[len] == ']')
+            len++;
+        if (len >= sizeof(hostname))
+            len = sizeof(hostname) - 1;
+        memcpy(hostname, host, len);
+        hostname[len] = 0;
+    } else {
+// HTTP/1.0: the address the client connected to
+        struct sockaddr_in local;
+        socklen_t size = sizeof(local);
+        if (getsockname(bufferevent_getfd(conn->bev), 
+                        (struct sockaddr *)&local, &size) < 0 ||
+            local.sin_family != AF_INET) {
+            evhtp_send_reply(req, EVHTP_RES_SERVUNAVAIL);
+            return;
+        }
+        inet_ntop(AF_INET, &local.sin_addr, hostname, sizeof(hostname));
+    }
+    const char *query = (const char *)req->uri->query_raw;
+    snprintf(location, sizeof(location), "http://%s:%ld%s%s%s", hostname, 
+             conf.streamport, req->uri->path->full, 
+             query && *query ? "?" : "", query ? query : "");
+    evhtp_headers_add_header(req->headers_out,
+          evhtp_header_new("Location", location, 0, 1));
+    req->flags |= EVHTP_REQ_FLAG_KEEPALIVE;
+    evhtp_send_reply(req, EVHTP_RES_TMPREDIR);
+}
+
+// send the picture that stmt, bound to the item or group, finds, as a
+// slice of the song's cached file segment
+static void send_artwork(evhtp_request_t *req, app *aux, sqlite3_stmt *stmt) {
+    CACHENODE *song = NULL;
+    int64_t start = 0;
+    size_t length = 0;
+    char mime[64] = "image/jpeg";
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        int id = sqlite3_column_int(stmt, 0);
+        start  = sqlite3_column_int64(stmt, 1);
+        length = sqlite3_column_int(stmt, 2);
+        if (sqlite3_column_text(stmt, 3))
+            snprintf(mime, sizeof(mime), "%s", sqlite3_column_text(stmt, 3));
+        sqlite3_reset(stmt);
+        song = cache_set_and_get(file_cache, id, aux);
+    } else 
+        sqlite3_reset(stmt);
+    if (!song || start < 0 || start + length > song->size) {
+        evhtp_send_reply(req, EVHTP_RES_NOTFOUND);
+        return;
+    }
+    evhtp_headers_add_header(req->headers_out,
+          evhtp_header_new("Content-Type", mime, 0, 1));
+    evbuffer_add_file_segment(req->buffer_out, song->file_segment, 
+                              start, length);
+    evhtp_send_reply(req, EVHTP_RES_OK);
+}
+
+/**
+ * @brief http handler for an item's artwork, sent from its audio file 
+ *        where the scanner found the picture.
+ */
+void res_item_artwork(evhtp_request_t *req, void *a) {
+    log_request(req, a);
+    ADD_DATE_HEADER("Date");
+    evthr_t *thread = evhtp_request_get_connection(req)->thread;
+    app *aux = (app *)evthr_get_aux(thread);
+    sqlite3_stmt *stmt = aux->stmts[Q_ITEM_ARTWORK];
+    sqlite3_bind_int(stmt, 1, uri_get_number(req->uri->path->path, 1));
+    send_artwork(req, aux, stmt);
+}
+
+/**
+ * @brief http handler for a group's artwork: that of its first track
+ *        with a picture.
+ */
+void res_group_artwork(evhtp_request_t *req, void *a) {
+    log_request(req, a);
+    ADD_DATE_HEADER("Date");
+    evthr_t *thread = evhtp_request_get_connection(req)->thread;
+    app *aux = (app *)evthr_get_aux(thread);
+    sqlite3_stmt *stmt = aux->stmts[Q_GROUP_ARTWORK];
+    sqlite3_bind_int(stmt, 1, uri_get_number(req->uri->path->path, 1));
+    send_artwork(req, aux, stmt);
+}
@@ -4,15 +4,24 @@
 #include <event2/event.h>
 #include <evhtp/evhtp.h>
 #include "cache.h"
+#include "util.h"
 
 typedef struct _cachenode {
     size_t size;
+    int fd;
     void *file_segment;
 } CACHENODE;
 
 extern CACHE *file_cache;
 
 void *create_segment(int id, void *a);
+void stream_set_sendfile_networks(const char *list);
+void stream_init_thread(app *aux);
+void stream_term_thread(app *aux);
+void stream_log_stats();
 void res_stream_item(evhtp_request_t *req, void *a);
+void res_stream_redirect(evhtp_request_t *req, void *a);
+void res_item_artwork(evhtp_request_t *req, void *a);
+void res_group_artwork(evhtp_request_t *req, void *a);
 
 #endif
@@ -15,6 +15,7 @@
 #include "system.h"
 #include "config.h"
 #include "scanner.h"
+#include "stream.h"
 
 #define SUPERUSER (uid_t)0
 
@@ -155,6 +156,8 @@ static void handle_signal(int sig) {
     }
     if (sig == SIGHUP) 
         scanner_submit_request(NULL); // do a full scan
+    if (sig == SIGUSR1)
+        stream_log_stats();
 }
 
 static void signal_cleanup(void *arg) {
@@ -7,10 +7,12 @@
 typedef enum fsw_event_flag fsw_event_flag;
 #include <libfswatch/c/libfswatch.h>
 #include "config.h"
+#include "stmtcache.h"
 
 
 typedef struct app_parent {
     evhtp_t  *htp;
+    evhtp_t  *streamhtp;    // the stream listener, if conf.streamport
     evbase_t *base;
     config_t *config;
 } app_parent;
@@ -24,6 +26,17 @@ typedef struct app {
     sqlite3      *db;
     config_t     *config;
     sqlite3_stmt **stmts; 
+    STMTCACHE    *stmtcache;  // statements for dynamically built queries
+    struct app   *spare;      // idle listing connections, see listing.c
+    struct app   *owner;      // the thread a listing connection is of
+    struct plan_t *plans;     // compiled meta profiles, see plan.c
+    struct _filter *filter;   // bound by sql_open_results(), see filter.c
+    struct longpoll_t *longpoll;  // parked /update requests
+    struct keyrange_t *range; // bound by sql_open_results(), see keyset.c
+    int           since, until;   // a delta listing's, bound likewise
+    struct streams_t *streams;    // chunked streams, see stream.c
+    struct reader_t *reader;      // read completions, see reader.c
+    struct bw_thread *bandwidth;  // parked streams, see bandwidth.c
 } app;
 
 void timestamp_rfc1123(char *buf) ;
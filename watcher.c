@@ -143,7 +143,7 @@ void *watcher_thread(void *arg) {
     const fsw_event_type_filter include_movedFrom = { MovedFrom };
     const fsw_event_type_filter include_updated   = { Updated };
     const fsw_event_type_filter include_renamed   = { Renamed };
-    app state;
+    app state = {0};
     int cleanup_pop_val;
     int ret;
     //config_t *conf = (config_t *)arg;
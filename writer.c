@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -15,12 +17,20 @@
 #include "scratch.h"
 #include "system.h"
 #include "util.h"
+#include "respcache.h"
+#include "browse.h"
+#include "filter.h"
+#include "sortkeys.h"
+#include "longpoll.h"
 
 volatile sig_atomic_t writer_active = 0;
 
 int statement_id = 0;
 
 #define TRANSACTION_SIZE 64
+#define WRITE_RETRY_US   10000
+#define COMMIT_TRIES     100      // a second, before the commit is put off
+#define COMMIT_IDLE_US   20000    // quiet before a short transaction commits
 
 static int db_return_int;
 static char *db_return_str;
@@ -31,6 +41,9 @@ static pthread_cond_t  writer_ready       = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t writer_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t db_status_mutex    = PTHREAD_MUTEX_INITIALIZER;
 volatile time_t db_updated;
+static volatile uint64_t db_revision = 1;
+static int smart_counts_stale = 1;
+static int browse_changed = 0;  // browse fields written since last commit
 volatile struct timeval 
     write_started,
     write_finished;
@@ -48,6 +61,19 @@ time_t db_last_update_time() {
 }
 
 
+/**
+ * @brief the library revision, bumped every time the writer commits.
+ *        anything derived from the database at revision r is stale
+ *        once this returns something other than r.
+ */
+uint64_t db_current_revision() {
+    uint64_t result;
+    pthread_mutex_lock(&db_status_mutex);
+    result = db_revision;
+    pthread_mutex_unlock(&db_status_mutex);
+    return result;
+}
+
 void db_init_status() {
     time_t now;
     time(&now);
@@ -308,11 +334,12 @@ int db_upsert_album(app *aux, const char *album, const char *album_sort,
 
 int db_upsert_song(app *aux, const char *title, const int path, 
         const int artist, const int album, const int genre, 
-        const int track, const int disc, const int song_length) {
+        const int track, const int disc, const int song_length,
+        const int bitrate) {
     size_t len = strlen(title) + 1;
     SCRATCH *s = scratch_new( 4*sizeof(query_t *) +
                               3*sizeof(query_t) +
-                              7*sizeof(int) +
+                              8*sizeof(int) +
                               1*sizeof(char *) +
                               len);
     query_t **q = scratch_get(s, 4*sizeof(query_t *));
@@ -323,9 +350,9 @@ int db_upsert_song(app *aux, const char *title, const int path,
     q[1] = scratch_get(s, sizeof(query_t));
     q[1]->type = Q_UPSERT_SONG;
     q[1]->n_str = 1;
-    q[1]->n_int = 7;
+    q[1]->n_int = 8;
     q[1]->strvals = scratch_get(s, sizeof(char *));
-    q[1]->intvals = scratch_get(s, 7*sizeof(int));
+    q[1]->intvals = scratch_get(s, 8*sizeof(int));
     q[1]->strvals[0] = scratch_get(s, len);
     strncpy(q[1]->strvals[0], title, len);
     q[1]->intvals[0] = (int)path;
@@ -335,6 +362,7 @@ int db_upsert_song(app *aux, const char *title, const int path,
     q[1]->intvals[4] = (int)track;
     q[1]->intvals[5] = (int)disc;
     q[1]->intvals[6] = (int)song_length;
+    q[1]->intvals[7] = (int)bitrate;
    
     q[2] = scratch_get(s, sizeof(query_t));
     q[2]->type = Q_GET_RETURN;
@@ -348,6 +376,149 @@ int db_upsert_song(app *aux, const char *title, const int path,
     //return 0;
 }
 
+/**
+ * @brief record where in its file a song's cover picture is, or with a
+ *        length of 0 that it has none.
+ */
+void db_set_artwork(const int song, const int64_t start, const int length,
+                    const char *mime) {
+    size_t len = mime ? strlen(mime) + 1 : 0;
+    SCRATCH *s = scratch_new( 2*sizeof(query_t *) +
+                              sizeof(query_t) +
+                              2*sizeof(int) +
+                              1*sizeof(int64_t) +
+                              1*sizeof(char *) +
+                              len);
+    query_t **q = scratch_get(s, 2*sizeof(query_t *));
+    q[0] = scratch_get(s, sizeof(query_t));
+    q[0]->intvals = scratch_get(s, 2*sizeof(int));
+    q[0]->intvals[0] = (int)song;
+    if (length > 0) {
+        q[0]->type = Q_SET_ARTWORK;
+        q[0]->n_int = 2;
+        q[0]->n_int64 = 1;
+        q[0]->n_str = 1;
+        q[0]->intvals[1] = (int)length;
+        q[0]->int64vals = scratch_get(s, sizeof(int64_t));
+        q[0]->int64vals[0] = start;
+        q[0]->strvals = scratch_get(s, sizeof(char *));
+        q[0]->strvals[0] = len ? scratch_get(s, len) : NULL;
+        if (len)
+            strncpy(q[0]->strvals[0], mime, len);
+    } else {
+        q[0]->type = Q_REMOVE_ARTWORK;
+        q[0]->n_int = 1;
+    }
+    scratch_free(s, SCRATCH_KEEP);
+    submit_write_query(q);
+}
+
+// limits Q_SMART_ITEMS to the songs the open transaction wrote
+#define SMART_CHANGED \
+    "AND s.id IN (SELECT ch.song FROM changes ch, revision r " \
+    "WHERE ch.revision = r.rev AND ch.deleted = 0)"
+
+/**
+ * @brief bring the smart playlists' items up to date.  plain playlists are
+ *        kept up to date by the playlistitems triggers, but a smart
+ *        playlist's query can only be evaluated here.  the smartitems
+ *        triggers keep the counts: at startup every song is matched, and
+ *        after that only the songs written or deleted since the last
+ *        commit are taken out of every smart playlist and matched again.
+ */
+static void update_smart_counts(app *aux, int changed) {
+    sqlite3_stmt *pl = aux->stmts[Q_SMART_PLAYLISTS];
+    const char *clause = changed ? SMART_CHANGED : "";
+    int n = 0;
+    if (changed) {
+        sqlite3_stmt *uncount = aux->stmts[Q_SMART_UNCOUNT];
+        if (sqlite3_step(uncount) != SQLITE_DONE)
+            LOGGER(LOG_ERR, "failed to uncount changed songs");
+        sqlite3_reset(uncount);
+    }
+    while (sqlite3_step(pl) == SQLITE_ROW) {
+        int id = sqlite3_column_int(pl, 0);
+        const char *query = sqlite3_column_text(pl, 1);
+        char *sqlstr = malloc(strlen(queries[Q_SMART_ITEMS].query) + 
+                              strlen(query) + strlen(clause) + 1);
+        sprintf(sqlstr, queries[Q_SMART_ITEMS].query, query, clause);
+        sqlite3_stmt *stmt = sql_open_results(aux, sqlstr, &id);
+        if (stmt) {
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                LOGGER(LOG_ERR, "failed to count smart playlist %d", id);
+            sql_close_results(aux, stmt);
+        }
+        free(sqlstr);
+        n++;
+    }
+    sqlite3_reset(pl);
+    smart_counts_stale = 0;
+    if (n && !changed) LOGGER(LOG_INFO, "counted %d smart playlists.", n);
+}
+
+// stamp the songs written by the open transaction, see the changes table
+static void stamp_revision(app *aux, uint64_t revision) {
+    sqlite3_stmt *stmt = aux->stmts[Q_SET_REVISION];
+    sqlite3_bind_int64(stmt, 1, revision);
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        LOGGER(LOG_ERR, "failed to set revision %lu", (unsigned long)revision);
+    sqlite3_reset(stmt);
+}
+
+// step a write, waiting out readers that hold the tables it writes.  with
+// the shared cache those are SQLITE_LOCKED, and the statement must be
+// reset before it is retried.
+static int step_write(sqlite3_stmt *stmt, int tries) {
+    int ret;
+    while ((ret = sqlite3_step(stmt)) == SQLITE_BUSY || 
+           (ret & 0xff) == SQLITE_LOCKED) {
+        sqlite3_reset(stmt);
+        if (--tries == 0) break;
+        usleep(WRITE_RETRY_US);
+    }
+    return ret;
+}
+
+/**
+ * @brief the db-write-access thread executes this to commit the current
+ *        transaction, start the next one, and publish the new revision.
+ *        a commit that a reader holds up is left open, to be tried again
+ *        on the next call; nothing is published until it succeeds.
+ * @return 1 if the transaction was committed
+ */
+static int commit_transaction(app *aux) {
+    time_t   now;
+    uint64_t revision;
+    if (smart_counts_stale)
+        update_smart_counts(aux, 1);
+    sqlite3_stmt *tx_end = aux->stmts[Q_END_TRANSACTION];
+    int ret = step_write(tx_end, COMMIT_TRIES);
+    sqlite3_reset(tx_end);
+    if (ret != SQLITE_DONE) {
+        LOGGER(LOG_ERR, "commit held up (error %d), will retry", ret);
+        return 0;
+    }
+    sqlite3_stmt *tx_begin = aux->stmts[Q_BEGIN_TRANSACTION];
+    sqlite3_step(tx_begin);
+    sqlite3_reset(tx_begin);
+    time(&now);
+    pthread_mutex_lock(&db_status_mutex);
+    db_updated = now;
+    revision   = ++db_revision;
+    pthread_mutex_unlock(&db_status_mutex);
+    stamp_revision(aux, revision + 1);
+    respcache_invalidate(revision);
+    if (browse_changed) {
+        browse_invalidate(browse_changed, revision);
+        filter_invalidate(revision);
+        browse_changed = 0;
+    }
+// every commit, so the permutations never fall a revision behind
+    sortkeys_refresh(aux, revision);
+    longpoll_wake();
+    return 1;
+}
+
 /**
  * @brief the db-write-access thread executes this to write to the database
  *        and return a value to the requesting thread if applicable
@@ -378,7 +549,22 @@ static int execute_write_query(app *aux, query_t **q_list) {
         }
 // a precompiled query, just bind params
         if (q->type < Q_PRECOMPILED_MAX) { 
-            
+            switch(q->type) {
+                case Q_UPSERT_SONG:
+                case Q_REMOVE_SONG:
+                case Q_REMOVE_PATH:
+                    smart_counts_stale = 1;
+                    browse_changed = B_ALL;
+                    break;
+                case Q_UPSERT_ARTIST: 
+                    browse_changed |= 1 << B_ARTISTS; break;
+                case Q_UPSERT_ALBUM:  
+                    browse_changed |= 1 << B_ALBUMS;  break;
+                case Q_UPSERT_GENRE:  
+                    browse_changed |= 1 << B_GENRES;  break;
+                default: break;
+            }
+
             sqlite3_stmt *stmt = aux->stmts[q->type];
             int *intval = q->intvals;
             int col = 0;
@@ -399,7 +585,7 @@ static int execute_write_query(app *aux, query_t **q_list) {
                 if (ret != SQLITE_OK)
                     LOGGER(LOG_ERR, "failed to bind str column.");
             }
-            while ((ret = sqlite3_step(stmt)) == SQLITE_BUSY);
+            ret = step_write(stmt, 0);
             if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
                 LOGGER(LOG_ERR, "failed to execute query '%s' error %d.", 
                         queries[q->type].name, ret);
@@ -428,16 +614,8 @@ static int execute_write_query(app *aux, query_t **q_list) {
             LOGGER(LOG_ERR, "query type not yet supported.");
         }
     }
-    if (statement_id > TRANSACTION_SIZE) {
+    if (statement_id > TRANSACTION_SIZE && commit_transaction(aux))
         statement_id = 0;
-        sqlite3_stmt *tx_end = aux->stmts[Q_END_TRANSACTION];
-       
-        ret = sqlite3_step(tx_end);
-        sqlite3_reset(tx_end);
-        sqlite3_stmt *tx_begin = aux->stmts[Q_BEGIN_TRANSACTION];
-        ret = sqlite3_step(tx_begin);
-        sqlite3_reset(tx_begin);
-    }
     gettimeofday((struct timeval *)&write_finished, NULL);
     writing = TIMESTAMP(write_finished) - TIMESTAMP(write_started);
 
@@ -481,7 +659,7 @@ static void writer_cleanup(void *arg) {
 void *writer_thread(void *arg) {
     writer_pid = pthread_self();
     //config_t *conf = (config_t *)arg;
-    app state;
+    app state = {0};
     state.config = &conf;
     int cleanup_pop_val;
     pthread_cleanup_push(writer_cleanup, &state);
@@ -500,10 +678,14 @@ void *writer_thread(void *arg) {
 // this only needs to be called once per database creation
 // but at this point, we don't know if we created or 
 // merely opened just now
-    ret = sqlite3_exec(state.db, "PRAGMA journal_mode = MEMORY;", 0, 0, 0);
-    //ret = sqlite3_exec(state.db, "PRAGMA journal_mode = WAL;", 0, 0, 0);
+// a file database lets readers keep their snapshots while the writer 
+// commits; an in-memory one can't, see step_write()
+    if (strstr(conf.dbfile, "mode=memory"))
+        ret = sqlite3_exec(state.db, "PRAGMA journal_mode = MEMORY;", 0, 0, 0);
+    else
+        ret = sqlite3_exec(state.db, "PRAGMA journal_mode = WAL;", 0, 0, 0);
     if (ret != SQLITE_OK) {
-        LOGGER(LOG_ERR, "failed to set sqlite3 journal_mode = WAL");
+        LOGGER(LOG_ERR, "failed to set sqlite3 journal_mode");
     }
     ret = sqlite3_exec(state.db, "PRAGMA synchronous = OFF;", 0, 0, 0);
     if (ret != SQLITE_OK) {
@@ -513,6 +695,11 @@ void *writer_thread(void *arg) {
     if (ret != SQLITE_OK) {
         LOGGER(LOG_ERR, "failed to set sqlite3 temp_store = MEMORY");
     }
+// so that INSERT OR REPLACE fires delete triggers, see the groups table
+    ret = sqlite3_exec(state.db, "PRAGMA recursive_triggers = ON;", 0, 0, 0);
+    if (ret != SQLITE_OK) {
+        LOGGER(LOG_ERR, "failed to set sqlite3 recursive_triggers = ON");
+    }
 // create tables, indexes, triggers
     for (t_type t = 0; t < T_MAX; t++) {
         ret = sqlite3_exec(state.db, tables[t].query, 0, 0, 0);
@@ -521,6 +708,16 @@ void *writer_thread(void *arg) {
         }
     }
     precompile_statements(&state);
+// carry on from the last revision committed to this database
+    sqlite3_stmt *get_rev = state.stmts[Q_GET_REVISION];
+    if (sqlite3_step(get_rev) == SQLITE_ROW) {
+        pthread_mutex_lock(&db_status_mutex);
+        db_revision = sqlite3_column_int64(get_rev, 0);
+        pthread_mutex_unlock(&db_status_mutex);
+    }
+    sqlite3_reset(get_rev);
+    respcache_invalidate(db_revision);
+    LOGGER(LOG_INFO, "library revision %lu", (unsigned long)db_revision);
 // alert threads that the database is up and ready for action
     pthread_mutex_lock(&writer_ready_mutex);
     writer_active = 1;
@@ -535,6 +732,8 @@ void *writer_thread(void *arg) {
     sqlite3_stmt *tx_begin = state.stmts[Q_BEGIN_TRANSACTION];
     sqlite3_step(tx_begin);
     sqlite3_reset(tx_begin);
+    stamp_revision(&state, db_revision + 1);
+    update_smart_counts(&state, 0);
     while (writer_active) {
         if (!conf.sequential) {
         //query_t **q = rb_popfront(writer_buffer);
@@ -549,6 +748,14 @@ void *writer_thread(void *arg) {
             if(q)
                 execute_write_query(&state, q);
         }
+// once the buffer stays empty a moment, commit what has been written
+// rather than leave it unpublished until the next write comes in
+        if (statement_id && rb_isempty(writer_buffer) == 1) {
+            usleep(COMMIT_IDLE_US);
+            while (statement_id && rb_isempty(writer_buffer) == 1)
+                if (commit_transaction(&state))
+                    statement_id = 0;
+        }
     }
     pthread_cleanup_pop(cleanup_pop_val);
     return NULL;
@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdint.h>
 #include "ringbuffer.h"
 #include "sql.h"
 extern volatile sig_atomic_t writer_active;
@@ -23,9 +24,12 @@ int  db_upsert_album     (app *aux, const char *album,
 int  db_upsert_song      (app *aux, const char *title, const int path, 
                           const int artist, const int album, 
                           const int genre, const int track, const int disc, 
-                          const int song_length);
+                          const int song_length, const int bitrate);
+void db_set_artwork      (const int song, const int64_t start, 
+                          const int length, const char *mime);
 void wait_for_writer     ();
 void *writer_thread      (void *arg);
 time_t db_last_update_time();
+uint64_t db_current_revision();
 void   db_init_status();
 #endif